@@ -0,0 +1,63 @@
+// arena.c
+//
+// This file contains the buffer arena shared by the test modes. Only one
+// of ITEST, TRACK and FRESP runs at a time, so each one borrows its buffers
+// from the same block of RAM when it is set up, invalidating whatever the
+// previous owner left there. Buffers are handed out zeroed.
+//
+// Author: Jared Berry
+//
+#include <string.h>
+#include "nu32dip.h"
+#include "arena.h"
+
+static unsigned char Arena[ARENA_BYTES] __attribute__((aligned(8)));
+static volatile Mode Owner = IDLE;      // Mode whose buffers are in the arena (IDLE = none)
+static unsigned int Used = 0;           // Bytes handed out to the owner
+static unsigned int Peak[NUM_MODES];    // Most bytes each mode has borrowed
+
+//
+// Hand the arena to a mode, discarding the previous owner's buffers.
+// Returns 0 if the previous owner is still running.
+//
+int arena_acquire(Mode owner) {
+    if (owner != Owner && Owner != IDLE && get_mode() == Owner) {
+        return 0;
+    }
+    Owner = owner;
+    Used = 0;
+    return 1;
+}
+
+//
+// Borrow a zeroed buffer for the present owner. Returns NULL if it does not fit.
+//
+void *arena_alloc(unsigned int bytes) {
+    bytes = (bytes + 7) & ~7u;      // Keep every buffer 8-byte aligned
+    if (Owner == IDLE || Used + bytes > ARENA_BYTES) {
+        return NULL;
+    }
+    void *p = &Arena[Used];
+    memset(p, 0, bytes);    // Samples a run never writes must not leak the last owner's data
+    Used += bytes;
+    if (Used > Peak[Owner]) {
+        Peak[Owner] = Used;
+    }
+    return p;
+}
+
+Mode arena_owner() { return Owner; }
+
+//
+// Send arena size, present owner and bytes in use, then the peak bytes
+// borrowed by each mode, one line per mode
+//
+void send_arena_report() {
+    char message[50];
+    sprintf(message, "%u %d %u\r\n", (unsigned int) ARENA_BYTES, (int) Owner, Used);
+    NU32DIP_WriteUART1(message);
+    for (int i = 0; i < NUM_MODES; i++) {
+        sprintf(message, "%u\r\n", Peak[i]);
+        NU32DIP_WriteUART1(message);
+    }
+}
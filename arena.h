@@ -0,0 +1,15 @@
+#ifndef ARENA__H__
+#define ARENA__H__
+
+#include "utilities.h"
+
+// Sized for TRACK, the largest user: reference, angle, current and duty per
+// sample. 18.4 KB, within the static ITEST, TRACK and FRESP buffers it replaced.
+#define ARENA_BYTES (TRAJ_NUMSAMPS * 4 * sizeof(short))
+
+int arena_acquire(Mode owner);
+void *arena_alloc(unsigned int bytes);
+Mode arena_owner();
+void send_arena_report();
+
+#endif // ARENA__H__
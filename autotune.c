@@ -0,0 +1,267 @@
+// autotune.c
+//
+// This file contains the on-device relay autotuner (Astrom-Hagglund).
+// AUTOTUNE first replaces the current controller with a relay on the
+// current error, then, with the newly tuned current loop running, puts a
+// relay on the position error. Each relay drives the loop into a limit
+// cycle whose amplitude a and period Tu (timed between switches) give the
+// ultimate gain
+//
+//   Ku = 4*d / (pi*sqrt(a^2 - eps^2))
+//
+// for relay amplitude d and hysteresis eps. PID gains follow from the
+// selected tuning rule and are applied from the control ISR, so a loop
+// never runs with a partial set.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include "nu32dip.h"
+#include "autotune.h"
+#include "utilities.h"
+#include "scheduler.h"
+#include "encoder.h"
+#include "current_control.h"
+#include "position_control.h"
+
+#define AT_SETTLE_CYCLES 2          // Limit cycles discarded before measuring
+#define AT_MEASURE_CYCLES 4         // Limit cycles averaged
+#define AT_CURRENT_TIMEOUT_MS 500   // Max duration of the current experiment
+#define AT_POSITION_TIMEOUT_MS 8000 // Max duration of the position experiment
+#define AT_POSITION_HYST 1.0f       // Position relay hysteresis (counts)
+#define AT_PI 3.14159265f
+
+typedef struct {
+    float relay;            // Relay output amplitude
+    float hyst;             // Hysteresis on the error
+    int out;                // Relay output sign
+    int ticks;              // Ticks since the experiment started
+    int last_switch;        // Tick of the last switch to positive output
+    int cycles;             // Completed cycles, including settling ones
+    float err_max, err_min; // Error extremes within the current cycle
+    float amp_sum;          // Sum of measured half peak-to-peak amplitudes
+    int period_sum;         // Sum of measured periods (ticks)
+} Relay;
+
+typedef struct {
+    float kp, ti, td;       // Kp/Ku, Ti/Tu, Td/Tu
+} Rule;
+
+static const Rule Rules[AT_NUM_RULES] = {
+    {0.6f, 0.5f, 0.125f},           // Ziegler-Nichols PID
+    {0.45f, 1.0f / 1.2f, 0.0f},     // Ziegler-Nichols PI
+    {1.0f / 2.2f, 2.2f, 1.0f / 6.3f}, // Tyreus-Luyben PID
+    {0.2f, 0.5f, 1.0f / 3.0f},      // No overshoot PID
+};
+
+static volatile AutotunePhase Phase = AT_IDLE;
+static volatile TuningRule RuleSel = AT_RULE_ZN_PID;
+static Relay Curr, Pos;
+static volatile int Center = 0;                 // Position held around (counts)
+static volatile int CenterSet = 0;              // Center taken from a position sample
+static volatile int Timeout = 0;                // Ticks left in the phase
+static float OldCurr[3], OldPos[3];             // Gains to restore if the run does not finish
+
+// Results
+static volatile float CurrKu = 0, CurrTu = 0;   // %/mA, s
+static volatile float PosKu = 0, PosTu = 0;     // mA/deg, s
+static volatile float CurrGains[3], PosGains[3];
+
+static void relay_reset(Relay *r, float relay, float hyst) {
+    r->relay = relay;
+    r->hyst = hyst;
+    r->out = 1;
+    r->ticks = 0;
+    r->last_switch = -1;
+    r->cycles = 0;
+    r->err_max = r->err_min = 0;
+    r->amp_sum = 0;
+    r->period_sum = 0;
+}
+
+//
+// Relay with hysteresis. Returns the output; a full cycle is closed on
+// every switch to positive output.
+//
+static float relay_update(Relay *r, float error) {
+    r->ticks++;
+    if (error > r->err_max) { r->err_max = error; }
+    if (error < r->err_min) { r->err_min = error; }
+
+    if (r->out < 0 && error > r->hyst) {
+        r->out = 1;
+        if (r->last_switch >= 0) {
+            r->cycles++;
+            if (r->cycles > AT_SETTLE_CYCLES) {
+                r->amp_sum += (r->err_max - r->err_min) / 2.0f;
+                r->period_sum += r->ticks - r->last_switch;
+            }
+        }
+        r->last_switch = r->ticks;
+        r->err_max = r->err_min = error;
+    } else if (r->out > 0 && error < -r->hyst) {
+        r->out = -1;
+    }
+    return r->out * r->relay;
+}
+
+static int relay_done(const Relay *r) {
+    return r->cycles >= AT_SETTLE_CYCLES + AT_MEASURE_CYCLES;
+}
+
+//
+// Ultimate gain and period (ticks) from the measured cycles. Returns 0
+// if the oscillation is too small to measure.
+//
+static int relay_result(const Relay *r, float *ku, float *tu_ticks) {
+    float a = r->amp_sum / AT_MEASURE_CYCLES;
+    if (a <= r->hyst) {
+        return 0;
+    }
+    *ku = 4.0f * r->relay / (AT_PI * sqrtf(a*a - r->hyst*r->hyst));
+    *tu_ticks = (float) r->period_sum / AT_MEASURE_CYCLES;
+    return 1;
+}
+
+//
+// Discrete PID gains for a loop sampled every ts seconds. Ki and Kd act on
+// the per-sample error sum and difference, as in the controllers.
+//
+static void rule_gains(float ku, float tu, float ts, volatile float *g) {
+    const Rule *r = &Rules[RuleSel];
+    float kp = r->kp * ku;
+    g[0] = kp;
+    g[1] = kp * ts / (r->ti * tu);
+    g[2] = kp * r->td * tu / ts;
+}
+
+//
+// Put back the gains from before the run and mark it failed
+//
+static void abandon(void) {
+    set_curr_kp(OldCurr[0]); set_curr_ki(OldCurr[1]); set_curr_kd(OldCurr[2]);
+    set_pos_kp(OldPos[0]); set_pos_ki(OldPos[1]); set_pos_kd(OldPos[2]);
+    Phase = AT_FAILED;
+}
+
+static void fail(void) {
+    abandon();
+    set_mode(IDLE);
+}
+
+//
+// Called by the current loop every tick, before its controller runs. If
+// AUTOTUNE was left before it finished, by a fault or a mode change from
+// the client, the gains from before the run are restored.
+//
+void autotune_watch(Mode m) {
+    if ((Phase == AT_CURRENT || Phase == AT_POSITION) && m != AUTOTUNE) {
+        abandon();  // Leave the new mode as it is
+    }
+}
+
+//
+// Start autotuning. curr_relay is the current relay amplitude (% duty),
+// curr_hyst its hysteresis (mA), pos_relay the position relay amplitude
+// (mA). Returns 0 if the controller cannot enter AUTOTUNE.
+//
+int autotune_start(TuningRule rule, int curr_relay, float curr_hyst, float pos_relay) {
+    __builtin_disable_interrupts();
+    OldCurr[0] = get_curr_kp(); OldCurr[1] = get_curr_ki(); OldCurr[2] = get_curr_kd();
+    OldPos[0] = get_pos_kp(); OldPos[1] = get_pos_ki(); OldPos[2] = get_pos_kd();
+    RuleSel = rule;
+    relay_reset(&Curr, curr_relay, curr_hyst);
+    relay_reset(&Pos, pos_relay, AT_POSITION_HYST);
+    CurrKu = CurrTu = PosKu = PosTu = 0;
+    for (int i = 0; i < 3; i++) {
+        CurrGains[i] = PosGains[i] = 0;
+    }
+    Timeout = AT_CURRENT_TIMEOUT_MS * scheduler_rate() / 1000;
+    Phase = AT_CURRENT;
+    set_mode(AUTOTUNE);
+    int ok = (get_mode() == AUTOTUNE);
+    if (!ok) {
+        Phase = AT_FAILED;
+    }
+    __builtin_enable_interrupts();
+    return ok;
+}
+
+int autotune_current_phase(void) { return Phase == AT_CURRENT; }
+
+//
+// Current experiment, called by the current loop every tick. Returns the
+// duty cycle (%) to apply.
+//
+int autotune_current_tick(float current) {
+    float duty = relay_update(&Curr, -current);     // Reference is 0 mA
+    if (relay_done(&Curr)) {
+        float ku, tu;
+        if (!relay_result(&Curr, &ku, &tu)) {
+            fail();
+            return 0;
+        }
+        CurrKu = ku;
+        CurrTu = tu / scheduler_rate();
+        rule_gains(CurrKu, CurrTu, 1.0f / scheduler_rate(), CurrGains);
+        set_curr_kp(CurrGains[0]); set_curr_ki(CurrGains[1]); set_curr_kd(CurrGains[2]);
+
+        Phase = AT_POSITION;
+        Timeout = AT_POSITION_TIMEOUT_MS * POSITION_LOOP_HZ / 1000;
+        CenterSet = 0;  // Taken from the first position sample
+        set_torque(0);
+        return 0;
+    }
+    if (--Timeout <= 0) {
+        fail();
+        return 0;
+    }
+    return (int) duty;
+}
+
+//
+// Position experiment, called by the position loop every update
+//
+void autotune_position_tick(int pos) {
+    if (Phase != AT_POSITION) {
+        return;
+    }
+    if (!CenterSet) {
+        Center = pos;
+        CenterSet = 1;
+        set_angle(pos);
+    }
+    set_torque(relay_update(&Pos, (float) (Center - pos)));
+
+    if (relay_done(&Pos)) {
+        float ku, tu;
+        if (!relay_result(&Pos, &ku, &tu)) {
+            fail();
+            return;
+        }
+        PosKu = ku * ENC_COUNTS_PER_DEG;     // mA/count to mA/deg
+        PosTu = tu / POSITION_LOOP_HZ;
+        rule_gains(PosKu, PosTu, 1.0f / POSITION_LOOP_HZ, PosGains);
+        set_pos_kp(PosGains[0]); set_pos_ki(PosGains[1]); set_pos_kd(PosGains[2]);
+        Phase = AT_DONE;
+        set_mode(HOLD);     // Hold the starting position with the new gains
+        return;
+    }
+    if (--Timeout <= 0) {
+        fail();
+    }
+}
+
+//
+// Send "phase rule", the current loop "Ku Tu(ms) kp ki kd" and the
+// position loop "Ku Tu(ms) kp ki kd"
+//
+void send_autotune_report() {
+    char message[100];
+    sprintf(message, "%d %d\r\n", (int) Phase, (int) RuleSel);
+    NU32DIP_WriteUART1(message);
+    sprintf(message, "%f %f %f %f %f\r\n", CurrKu, CurrTu * 1000.0f, CurrGains[0], CurrGains[1], CurrGains[2]);
+    NU32DIP_WriteUART1(message);
+    sprintf(message, "%f %f %f %f %f\r\n", PosKu, PosTu * 1000.0f, PosGains[0], PosGains[1], PosGains[2]);
+    NU32DIP_WriteUART1(message);
+}
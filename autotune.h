@@ -0,0 +1,29 @@
+#ifndef AUTOTUNE__H__
+#define AUTOTUNE__H__
+
+#include "utilities.h"
+
+typedef enum {
+    AT_IDLE,            // Never run
+    AT_CURRENT,         // Relay experiment on the current loop
+    AT_POSITION,        // Relay experiment on the position loop
+    AT_DONE,            // Gains applied
+    AT_FAILED           // No usable oscillation, or interrupted; gains unchanged
+} AutotunePhase;
+
+typedef enum {
+    AT_RULE_ZN_PID,         // Ziegler-Nichols PID
+    AT_RULE_ZN_PI,          // Ziegler-Nichols PI
+    AT_RULE_TL_PID,         // Tyreus-Luyben PID
+    AT_RULE_NO_OVERSHOOT,   // Ziegler-Nichols "no overshoot" PID
+    AT_NUM_RULES
+} TuningRule;
+
+int autotune_start(TuningRule rule, int curr_relay, float curr_hyst, float pos_relay);
+int autotune_current_phase(void);
+int autotune_current_tick(float current);
+void autotune_position_tick(int pos);
+void autotune_watch(Mode m);
+void send_autotune_report();
+
+#endif // AUTOTUNE__H__
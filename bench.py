@@ -0,0 +1,210 @@
+# bench.py
+#
+# This file contains the command round-trip benchmark. Each menu command
+# is fired many times, both one at a time (unpipelined) and with several
+# commands in flight (pipelined), and the round-trip latency percentiles
+# and sustained bytes per second in each direction are reported and saved
+# as JSON, so firmware builds can be compared. Runs against a real board
+# or a board_sim.py pty. Commands that move the motor are only run on a
+# real board with --allow-motion.
+#
+# Author: ME333, Jared Berry
+#
+import argparse
+import json
+import time
+from collections import deque
+import numpy as np
+import serial
+
+BAUD = 230400
+READ_TIMEOUT = 2.0      # Seconds to wait for a reply line
+FENCE = ('r', 1)        # Get mode, appended to commands without a reply
+MOTION_COMMANDS = {'traj_execute'}  # Power the motor on a real board
+
+def _lines(*lines):
+    return ''.join(str(line) + '\n' for line in lines).encode()
+
+def build_commands(gains, traj_len):
+    """
+    Commands to benchmark, as name -> (request bytes, reply lines, fenced).
+    Commands with no reply are followed by a fence command, and their
+    latency runs until the fence's reply. Gain setters re-send the gains
+    already on the board.
+
+    :param gains: (current gains, position gains) read from the board.
+    :param traj_len: Samples in the uploaded trajectory.
+    """
+    curr, pos = gains
+    traj = [round(30*np.sin(2*np.pi*i/traj_len), 2) for i in range(traj_len)]
+    return {
+        'read_current':      (_lines('b'), 1, False),
+        'read_enc_counts':   (_lines('c'), 1, False),
+        'read_enc_deg':      (_lines('d'), 1, False),
+        'get_mode':          (_lines('r'), 1, False),
+        'get_curr_gains':    (_lines('h'), 3, False),
+        'get_pos_gains':     (_lines('j'), 3, False),
+        'set_curr_gains':    (_lines('g', *curr), 0, True),
+        'set_pos_gains':     (_lines('i', *pos), 0, True),
+        'get_metrics':       (_lines('s'), 2, False),
+        'traj_upload':       (_lines('a', traj_len, *traj), 0, True),
+        'traj_readback':     (_lines('N'), traj_len + 1, False),
+        'traj_execute':      (_lines('o'), traj_len + 1, False),   # Runs the trajectory
+    }
+
+def read_gains(ser):
+    gains = []
+    for cmd in ('h', 'j'):
+        ser.write(_lines(cmd))
+        gains.append([ser.read_until(b'\n').decode().strip() for _ in range(3)])
+    return gains
+
+def run_command(ser, request, replies, fenced, iterations, depth):
+    """
+    Sends request iterations times, keeping up to depth commands in
+    flight, and times each from its write to the last line of its reply.
+
+    :return: Dictionary of latency statistics and throughput.
+    """
+    if fenced:
+        request += _lines(FENCE[0])
+        replies += FENCE[1]
+    in_flight = deque()
+    latencies = []
+    sent = 0
+    tx = rx = 0
+    errors = 0
+    ser.reset_input_buffer()
+    start = time.perf_counter()
+    while len(latencies) + errors < iterations:
+        while sent < iterations and len(in_flight) < depth:
+            in_flight.append(time.perf_counter())
+            ser.write(request)
+            tx += len(request)
+            sent += 1
+        t_sent = in_flight.popleft()
+        ok = True
+        for _ in range(replies):
+            line = ser.read_until(b'\n')
+            rx += len(line)
+            if not line.endswith(b'\n'):
+                ok = False      # Lost reply, e.g. a receive overrun on the board
+                break
+        if ok:
+            latencies.append(time.perf_counter() - t_sent)
+        else:
+            errors += 1
+            errors += len(in_flight)    # Drop whatever is still outstanding
+            in_flight.clear()
+            time.sleep(READ_TIMEOUT)
+            ser.reset_input_buffer()
+    elapsed = time.perf_counter() - start
+
+    lat = np.array(latencies) * 1000.0
+    return {
+        'iterations': iterations,
+        'depth': depth,
+        'errors': errors,
+        'p50_ms': float(np.percentile(lat, 50)) if len(lat) else None,
+        'p99_ms': float(np.percentile(lat, 99)) if len(lat) else None,
+        'max_ms': float(lat.max()) if len(lat) else None,
+        'mean_ms': float(lat.mean()) if len(lat) else None,
+        'commands_per_s': len(lat) / elapsed,
+        'tx_bytes_per_s': tx / elapsed,
+        'rx_bytes_per_s': rx / elapsed,
+    }
+
+def benchmark(ser, names=None, iterations=2000, traj_iterations=20, traj_len=50, depth=4,
+              allow_motion=False):
+    """
+    Benchmarks every command unpipelined and pipelined.
+
+    :param names: Commands to run, all by default.
+    :param allow_motion: Also run MOTION_COMMANDS, which drive the motor.
+    :param traj_iterations: Iterations for the trajectory commands, which
+                            are far slower than the rest.
+    :param depth: Commands in flight when pipelined. The firmware reads
+                  its UART by polling, so deep pipelines can overrun it.
+    :return: Dictionary of command -> {'unpipelined', 'pipelined'} results.
+    """
+    commands = build_commands(read_gains(ser), traj_len)
+    # Upload a trajectory first, so traj_readback and traj_execute have one
+    ser.write(commands['traj_upload'][0])
+    results = {}
+    for name, (request, replies, fenced) in commands.items():
+        if names and name not in names:
+            continue
+        if name in MOTION_COMMANDS and not allow_motion:
+            print(f'{name:16s} skipped, it moves the motor (use --allow-motion)')
+            continue
+        n = traj_iterations if name.startswith('traj') else iterations
+        results[name] = {}
+        for mode, d in (('unpipelined', 1), ('pipelined', depth)):
+            r = run_command(ser, request, replies, fenced, n, d)
+            results[name][mode] = r
+            p50 = f"{r['p50_ms']:.3f}" if r['p50_ms'] is not None else '-'
+            p99 = f"{r['p99_ms']:.3f}" if r['p99_ms'] is not None else '-'
+            mx = f"{r['max_ms']:.3f}" if r['max_ms'] is not None else '-'
+            print(f"{name:16s} {mode:11s} p50 {p50:>8s} ms  p99 {p99:>8s} ms  max {mx:>8s} ms  "
+                  f"tx {r['tx_bytes_per_s']:8.0f} B/s  rx {r['rx_bytes_per_s']:8.0f} B/s  "
+                  f"errors {r['errors']}")
+    ser.write(_lines('p'))  # Leave the motor unpowered
+    return results
+
+def compare(results, baseline):
+    """
+    Prints the change in p50 and p99 latency against an earlier JSON report.
+    """
+    print('\nChange against baseline (ms):')
+    for name, modes in results.items():
+        for mode, r in modes.items():
+            b = baseline.get('results', {}).get(name, {}).get(mode)
+            if not b or b['p50_ms'] is None or r['p50_ms'] is None:
+                continue
+            print(f"{name:16s} {mode:11s} p50 {r['p50_ms'] - b['p50_ms']:+8.3f}  "
+                  f"p99 {r['p99_ms'] - b['p99_ms']:+8.3f}")
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark command round trips to the motor controller.')
+    parser.add_argument('port', nargs='?', help='Serial port of the board')
+    parser.add_argument('--sim', action='store_true', help='Benchmark a simulated board instead')
+    parser.add_argument('-n', '--iterations', type=int, default=2000)
+    parser.add_argument('--traj-iterations', type=int, default=20)
+    parser.add_argument('--traj-len', type=int, default=50, help='Trajectory samples')
+    parser.add_argument('--depth', type=int, default=4, help='Commands in flight when pipelined')
+    parser.add_argument('--commands', nargs='+', help='Only these commands')
+    parser.add_argument('--label', default='', help='Firmware build label stored in the report')
+    parser.add_argument('-o', '--output', default='bench.json', help='JSON report')
+    parser.add_argument('--compare', help='Earlier JSON report to compare against')
+    parser.add_argument('--allow-motion', action='store_true',
+                        help='Also run traj_execute, which powers the motor through the trajectory')
+    args = parser.parse_args()
+    if not args.port and not args.sim:
+        parser.error('give a port or --sim')
+
+    sim = None
+    port = args.port
+    if args.sim:
+        from board_sim import BoardSim
+        sim = BoardSim()
+        port = sim.start()
+    try:
+        with serial.Serial(port, BAUD, timeout=READ_TIMEOUT) as ser:
+            # A simulated board has no motor to move
+            results = benchmark(ser, args.commands, args.iterations, args.traj_iterations,
+                                args.traj_len, args.depth, args.allow_motion or bool(sim))
+    finally:
+        if sim:
+            sim.close()
+
+    report = {'port': port, 'simulated': bool(sim), 'label': args.label, 'baud': BAUD,
+              'timestamp': time.time(), 'results': results}
+    with open(args.output, 'w') as f:
+        json.dump(report, f, indent=2)
+    print(f'\nSaved to {args.output}')
+    if args.compare:
+        with open(args.compare) as f:
+            compare(results, json.load(f))
+
+if __name__ == "__main__":
+    main()
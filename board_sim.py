@@ -0,0 +1,237 @@
+# board_sim.py
+#
+# This file contains a pty-backed stand-in for the PIC32 motor controller.
+# Each simulated board opens a pseudo-terminal and answers the core menu
+# commands (a-u) with the same line protocol as main.c, using a crude
+# motor model, so the clients and benchmarks can run without hardware.
+# Both directions are paced at the UART baud rate unless it is set to 0.
+#
+# Author: ME333, Jared Berry
+#
+import argparse
+import math
+import os
+import random
+import threading
+import time
+import tty
+
+ENC_COUNTS_PER_DEG = 3.7111     # Encoder resolution, as in encoder.h
+ITEST_NUMSAMPS = 100            # As in utilities.h
+POSITION_LOOP_HZ = 200
+CURRENT_LOOP_HZ = 5000
+BAUD = 230400
+
+MODE_IDLE, MODE_PWM, MODE_ITEST, MODE_HOLD, MODE_TRACK = 0, 1, 2, 3, 4
+
+def _metrics_line(ref, actual, scale=1.0):
+    """
+    :return: Metrics summary line in the format of metrics_sprint().
+    """
+    n = len(ref)
+    if n == 0:
+        return '0.000000 0.000000 0.000000 nan nan nan 0 0\r\n'
+    err = [abs(r - a) for r, a in zip(ref, actual)]
+    mae = sum(err)/n*scale
+    rms = math.sqrt(sum(e*e for e in err)/n)*scale
+    return f'{mae:f} {rms:f} {max(err)*scale:f} nan nan nan 0 {n}\r\n'
+
+class BoardSim:
+    """
+    One simulated board on its own pty.
+
+    :param baud: Link pacing in both directions (bits/s), 0 for unpaced.
+    :param realtime: Take as long as the real board to run trajectories.
+    """
+    def __init__(self, baud=BAUD, realtime=True, seed=None):
+        self.baud = baud
+        self.realtime = realtime
+        self.rng = random.Random(seed)
+        self.master, self._slave = os.openpty()
+        tty.setraw(self._slave)
+        self.port = os.ttyname(self._slave)
+        self._buf = b''
+        self._thread = None
+        self._running = False
+
+        self.mode = MODE_IDLE
+        self.counts = 0
+        self.pwm = 0
+        self.curr_gains = [0.0, 0.0, 0.0]
+        self.pos_gains = [0.0, 0.0, 0.0]
+        self.traj = []                  # Reference (counts)
+        self.itest_metrics = _metrics_line([], [])
+        self.track_metrics = _metrics_line([], [])
+
+    # ---------------- Serial line I/O ----------------
+
+    def _readline(self):
+        while b'\n' not in self._buf and b'\r' not in self._buf:
+            data = os.read(self.master, 4096)
+            if not data:
+                raise EOFError
+            if self.baud:
+                time.sleep(len(data)*10/self.baud)  # Time the bytes take on the wire
+            self._buf += data
+        cut = min(i for i in (self._buf.find(b'\n'), self._buf.find(b'\r')) if i >= 0)
+        line, self._buf = self._buf[:cut], self._buf[cut+1:]
+        if line == b'':
+            return self._readline()     # \r\n or blank line, like NU32DIP_ReadUART1
+        return line.decode()
+
+    def _write(self, text):
+        data = text.encode()
+        os.write(self.master, data)
+        if self.baud:
+            time.sleep(len(data)*10/self.baud)
+
+    # ---------------- Motor model ----------------
+
+    def _current(self):
+        if self.mode == MODE_PWM:
+            return self.pwm*6.0 + self.rng.gauss(0, 2)
+        return self.rng.gauss(0, 2)
+
+    def _run_itest(self):
+        wave = [200.0 if (i < 25 or 50 <= i < 75) else -200.0 for i in range(ITEST_NUMSAMPS)]
+        cur, actual, duty = 0.0, [], []
+        for ref in wave:
+            cur += 0.3*(ref - cur) + self.rng.gauss(0, 2)
+            actual.append(cur)
+            duty.append(max(-100.0, min(100.0, ref/4)))
+        if self.realtime:
+            time.sleep(ITEST_NUMSAMPS/CURRENT_LOOP_HZ)
+        self.itest_metrics = _metrics_line(wave, actual)
+        return wave, actual, duty
+
+    def _run_track(self):
+        pos, actual, current, duty = float(self.counts), [], [], []
+        for ref in self.traj:
+            u = 50.0*(ref - pos)
+            pos += 0.35*(ref - pos) + self.rng.gauss(0, 0.3)
+            actual.append(pos)
+            current.append(int(max(-1000, min(1000, u))))
+            duty.append(max(-100.0, min(100.0, u/10)))
+        if self.realtime:
+            time.sleep(len(self.traj)/POSITION_LOOP_HZ)
+        if actual:
+            self.counts = int(round(actual[-1]))
+        self.mode = MODE_HOLD
+        self.track_metrics = _metrics_line(self.traj, actual, 1/ENC_COUNTS_PER_DEG)
+        return actual, current, duty
+
+    # ---------------- Menu ----------------
+
+    def _read_traj(self):
+        length = int(self._readline())
+        self.traj = [round(float(self._readline())*ENC_COUNTS_PER_DEG) for _ in range(length)]
+        if not 0 < length <= 2300 or any(abs(c) > 32767 for c in self.traj):
+            self.traj = []
+
+    def _read_gains(self):
+        return [float(self._readline()) for _ in range(3)]
+
+    def handle(self, cmd):
+        """
+        Executes one menu command, reading its arguments and sending its
+        reply exactly as main.c does.
+        """
+        match cmd:
+            case 'a' | 'm' | 'n':
+                self._read_traj()
+            case 'b':
+                self._write(f'{self._current():f}\r\n')
+            case 'c':
+                self._write(f'{self.counts}\r\n')
+            case 'd':
+                self._write(f'{self.counts/ENC_COUNTS_PER_DEG:.2f}\r\n')
+            case 'e':
+                self.counts = 0
+            case 'f':
+                self.pwm = int(self._readline())
+                self.mode = MODE_PWM
+            case 'g':
+                self.curr_gains = self._read_gains()
+            case 'h':
+                self._write(''.join(f'{g:f}\r\n' for g in self.curr_gains))
+            case 'i':
+                self.pos_gains = self._read_gains()
+            case 'j':
+                self._write(''.join(f'{g:f}\r\n' for g in self.pos_gains))
+            case 'k':
+                wave, actual, duty = self._run_itest()
+                self._write(''.join(f'{ITEST_NUMSAMPS-i} {actual[i]:f} {wave[i]:f} {duty[i]:.1f}\r\n'
+                                    for i in range(ITEST_NUMSAMPS)))
+            case 'l':
+                self.counts = round(float(self._readline())*ENC_COUNTS_PER_DEG)
+                self.mode = MODE_HOLD
+            case 'o':
+                actual, current, duty = self._run_track() if self.traj else ([], [], [])
+                lines = [f'{len(actual)}\r\n']
+                lines += [f'{i} {actual[i]/ENC_COUNTS_PER_DEG:.2f} {self.traj[i]/ENC_COUNTS_PER_DEG:.2f} '
+                          f'{current[i]} {duty[i]:.1f}\r\n' for i in range(len(actual))]
+                self._write(''.join(lines))
+            case 'N':
+                lines = [f'{len(self.traj)}\r\n']
+                lines += [f'{c/ENC_COUNTS_PER_DEG:.2f}\r\n' for c in self.traj]
+                self._write(''.join(lines))
+            case 'p' | 'q':
+                self.mode = MODE_IDLE
+            case 'r':
+                self._write(f'{self.mode}\r\n')
+            case 's':
+                self._write(self.itest_metrics + self.track_metrics)
+            case 't':
+                if self.traj:
+                    self._run_track()
+                self._write(self.track_metrics)
+            case 'u':
+                self._run_itest()
+                self._write(self.itest_metrics)
+            case _:
+                pass    # Not emulated; the board only lights its error LED
+
+    def _serve(self):
+        try:
+            while self._running:
+                line = self._readline()
+                self.handle(line[0])
+        except (EOFError, OSError):
+            pass
+
+    def start(self):
+        """
+        Starts answering commands in a background thread.
+
+        :return: Path of the pty to open as the board's serial port.
+        """
+        self._running = True
+        self._thread = threading.Thread(target=self._serve, daemon=True)
+        self._thread.start()
+        return self.port
+
+    def close(self):
+        self._running = False
+        os.close(self._slave)
+        os.close(self.master)
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulate motor controller boards on ptys.')
+    parser.add_argument('-n', '--boards', type=int, default=1, help='Number of boards')
+    parser.add_argument('--baud', type=int, default=BAUD, help='Link pacing (bits/s), 0 for none')
+    parser.add_argument('--fast', action='store_true', help='Run trajectories without waiting')
+    args = parser.parse_args()
+
+    boards = [BoardSim(args.baud, not args.fast, seed=i) for i in range(args.boards)]
+    for b in boards:
+        print(b.start())
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+    for b in boards:
+        b.close()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,157 @@
+// capture.c
+//
+// This file contains the triggered capture engine. While armed, the
+// current loop writes current, current reference, duty cycle and angle
+// into a ring buffer every tick (or every decimation ticks). When the
+// trigger fires, the configured number of post-trigger samples is
+// recorded and the buffer freezes, keeping the samples leading up to the
+// event. The client uploads it on demand and re-arms.
+//
+// Author: Jared Berry
+//
+#include <stdlib.h>
+#include "nu32dip.h"
+#include "capture.h"
+#include "scheduler.h"
+
+#define CAPTURE_MASK (CAPTURE_DEPTH - 1)
+
+typedef struct {
+    short current;      // mA
+    short ref;          // Current reference (mA)
+    short duty;         // Signed OC1RS counts
+    short angle;        // Encoder counts
+} CaptureSample;
+
+static CaptureSample Buffer[CAPTURE_DEPTH];
+static volatile CaptureState State = CAP_STOPPED;
+static volatile CaptureTrigger Trigger = CAP_TRIG_HOST;
+static volatile int Level = 0;          // Trigger threshold
+static volatile int Post = 0;           // Samples recorded after the trigger
+static volatile int Decimation = 1;     // Ticks per stored sample
+static volatile int Head = 0;           // Next slot written
+static volatile int Filled = 0;         // Valid samples in the buffer, up to CAPTURE_DEPTH
+static volatile int Remaining = 0;      // Post-trigger samples still to record
+static volatile int Forced = 0;         // Host trigger pending
+static volatile int Rate = 0;           // Current loop rate when armed (Hz)
+static int DecimCount = 0;
+static Mode PrevMode = IDLE;
+
+static short clamp_short(int v) {
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+//
+// Check the trigger condition for this tick
+//
+static int triggered(Mode m, float current, float ref, int angle, int angle_ref) {
+    if (Forced) {
+        return 1;
+    }
+    switch (Trigger) {
+        case CAP_TRIG_CURRENT_ERROR:
+            return abs((int) (ref - current)) > Level;
+        case CAP_TRIG_POSITION_ERROR:
+            return (m == HOLD || m == TRACK || m == STREAM || m == QUEUE) && abs(angle_ref - angle) > Level;
+        case CAP_TRIG_CURRENT:
+            return abs((int) current) > Level;
+        case CAP_TRIG_MODE:
+            return m != PrevMode;
+        default:
+            return 0;
+    }
+}
+
+//
+// Record one current loop tick, called at the end of every tick.
+// The trigger is checked every tick, even when samples are decimated.
+//
+void capture_sample(Mode m, float current, float ref, int duty, int angle, int angle_ref) {
+    CaptureState s = State;
+    if (s == CAP_ARMED && triggered(m, current, ref, angle, angle_ref)) {
+        State = s = CAP_TRIGGERED;
+        Forced = 0;
+        Remaining = Post;
+        DecimCount = 0;     // Store the trigger sample itself
+    }
+    PrevMode = m;
+    if (s != CAP_ARMED && s != CAP_TRIGGERED) {
+        return;
+    }
+
+    if (DecimCount > 0) {
+        DecimCount--;
+        return;
+    }
+    DecimCount = Decimation - 1;
+
+    CaptureSample *p = &Buffer[Head];
+    p->current = clamp_short((int) current);
+    p->ref = clamp_short((int) ref);
+    p->duty = (short) duty;
+    p->angle = clamp_short(angle);
+    Head = (Head + 1) & CAPTURE_MASK;
+    if (Filled < CAPTURE_DEPTH) {
+        Filled++;
+    }
+
+    if (s == CAP_TRIGGERED && --Remaining <= 0) {
+        State = CAP_FROZEN;
+    }
+}
+
+//
+// Returns non-zero while samples are being recorded
+//
+int capture_running(void) {
+    return State == CAP_ARMED || State == CAP_TRIGGERED;
+}
+
+//
+// Arm the capture. post is the number of samples kept after the trigger
+// (the rest of the buffer holds samples before it), decimation the number
+// of ticks per stored sample.
+//
+void capture_arm(CaptureTrigger trig, int level, int post, int decimation) {
+    __builtin_disable_interrupts();
+    Trigger = trig;
+    Level = level;
+    Post = post < 1 ? 1 : (post > CAPTURE_DEPTH ? CAPTURE_DEPTH : post);
+    Decimation = decimation < 1 ? 1 : decimation;
+    Head = 0;
+    Filled = 0;
+    Forced = 0;
+    DecimCount = 0;
+    PrevMode = get_mode();
+    Rate = scheduler_rate();
+    State = CAP_ARMED;
+    __builtin_enable_interrupts();
+}
+
+//
+// Trigger from the host on the next tick
+//
+void capture_force(void) {
+    Forced = 1;
+}
+
+//
+// Send "state trigger rate decimation samples pre" and, once frozen, the
+// samples oldest first as "current ref duty angle". The pre samples come
+// before the trigger.
+//
+void send_capture() {
+    char message[60];
+    CaptureState s = State;
+    int n = (s == CAP_FROZEN) ? Filled : 0;
+    int pre = n ? n - Post : 0;     // The trigger sample is the first post-trigger one
+    sprintf(message, "%d %d %d %d %d %d\r\n", (int) s, (int) Trigger, Rate, Decimation, n, pre);
+    NU32DIP_WriteUART1(message);
+
+    int start = (Head - n) & CAPTURE_MASK;
+    for (int i = 0; i < n; i++) {
+        CaptureSample *p = &Buffer[(start + i) & CAPTURE_MASK];
+        sprintf(message, "%d %d %d %d\r\n", p->current, p->ref, p->duty, p->angle);
+        NU32DIP_WriteUART1(message);
+    }
+}
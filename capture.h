@@ -0,0 +1,30 @@
+#ifndef CAPTURE__H__
+#define CAPTURE__H__
+
+#include "utilities.h"
+
+#define CAPTURE_DEPTH 1024          // Samples held, must be a power of 2
+
+typedef enum {
+    CAP_TRIG_HOST,              // Only on a host command
+    CAP_TRIG_CURRENT_ERROR,     // |current reference - current| > level (mA)
+    CAP_TRIG_POSITION_ERROR,    // |angle reference - angle| > level (counts)
+    CAP_TRIG_CURRENT,           // |current| > level (mA)
+    CAP_TRIG_MODE,              // Any mode change
+    CAP_NUM_TRIGGERS
+} CaptureTrigger;
+
+typedef enum {
+    CAP_STOPPED,        // Not recording
+    CAP_ARMED,          // Recording, waiting for the trigger
+    CAP_TRIGGERED,      // Recording the post-trigger samples
+    CAP_FROZEN          // Buffer holds a capture, ready to upload
+} CaptureState;
+
+void capture_sample(Mode m, float current, float ref, int duty, int angle, int angle_ref);
+int capture_running(void);
+void capture_arm(CaptureTrigger trig, int level, int post, int decimation);
+void capture_force(void);
+void send_capture();
+
+#endif // CAPTURE__H__
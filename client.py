@@ -13,12 +13,61 @@
 
 import serial
 import matplotlib.pyplot as plt
-from traj_plot import plot_itest, gen_ref_trajectory, plot_trajectory
+from traj_plot import plot_itest, gen_ref_trajectory, plot_trajectory, read_metrics, print_metrics, plot_bode
+from traj_plot import stream_setpoints, input_optimal_trajectory, input_filter, print_filter_costs, plot_capture
+from math import sin, pi
+from run_log import RunLog
+import json
+import time
 ser = serial.Serial('com4',230400)
+log = RunLog('runs')    # Every executed run is appended here
+
+# Controller modes, in the order of the Mode enum in utilities.h
+MODES = ['IDLE', 'PWM', 'ITEST', 'HOLD', 'TRACK', 'FRESP', 'STREAM', 'QUEUE', 'AUTOTUNE']
 
 # Best Current Gains: Kp=0.002, Ki=0.14, Kd=0
 # Best Position Gains: Kp=100, Ki=0, Kd=4000
 
+def read_gains():
+    """
+    Reads the current and position gains from the PIC, for logging.
+
+    :return: Dictionary of gains.
+    """
+    gains = {}
+    for cmd, loop in (('h', 'curr'), ('j', 'pos')):
+        ser.write((cmd+'\n').encode())
+        for name in ('kp', 'ki', 'kd'):
+            gains[f'{loop}_{name}'] = float(ser.read_until(b'\n'))
+    return gains
+
+AUTOTUNE_PHASES = ['NOT RUN', 'CURRENT', 'POSITION', 'DONE', 'FAILED']
+AUTOTUNE_RULES = ['Ziegler-Nichols PID', 'Ziegler-Nichols PI', 'Tyreus-Luyben PID', 'No overshoot PID']
+
+def read_autotune(ser):
+    """
+    Reads the autotune report sent after menu command "L".
+
+    :return: Dictionary with the phase, rule and per-loop results.
+    """
+    phase, rule = map(int, ser.read_until(b'\n').split())
+    report = {'phase': AUTOTUNE_PHASES[phase], 'rule': AUTOTUNE_RULES[rule]}
+    for loop in ('current', 'position'):
+        ku, tu, kp, ki, kd = map(float, ser.read_until(b'\n').split())
+        report[loop] = {'ku': ku, 'tu_ms': tu, 'kp': kp, 'ki': ki, 'kd': kd}
+    return report
+
+def print_autotune(report):
+    """
+    Prints an autotune report from read_autotune().
+    """
+    print(f"Autotune {report['phase']} ({report['rule']})")
+    for loop, unit in (('current', '%/mA'), ('position', 'mA/deg')):
+        r = report[loop]
+        print(f"\t{loop}: Ku = {r['ku']:.4g} {unit}, Tu = {r['tu_ms']:.2f} ms -> "
+              f"Kp = {r['kp']:.4g}, Ki = {r['ki']:.4g}, Kd = {r['kd']:.4g}")
+    print()
+
 def main():
     print('***ENTERING CLIENT***\n')
     print('\nOpening port: ')
@@ -31,6 +80,7 @@ def main():
 
         # Display the menu options this list will grow
         print(
+            '\ta: Load time-optimal trajectory\n'
             '\tb: Read current sensor (mA)'
             '\tc: Read encoder (counts)\n'
             '\td: Read encoder (degrees)'
@@ -47,7 +97,33 @@ def main():
             '\to: Execute trajectory\n'
             '\tp: Unpower the motor'
             '\t\tq: Quit\n'
-            '\tr: Get mode\n'
+            '\tr: Get mode'
+            '\t\t\ts: Get run metrics\n'
+            '\tt: Execute trajectory (metrics only)'
+            '\tu: Test current gains (metrics only)\n'
+            '\tv: Current loop frequency response'
+            '\tw: Get fault status\n'
+            '\tx: Clear fault'
+            '\t\t\ty: Set protection limits\n'
+            '\tz: Stream sine setpoints'
+            '\t\tA: Queue go to angle\n'
+            '\tB: Queue via-point trajectory'
+            '\tC: Queue dwell\n'
+            '\tD: Get queue status'
+            '\t\tE: Execute queue\n'
+            '\tF: Set feedforward model'
+            '\t\tG: Set measurement filter\n'
+            '\tH: Get filter costs'
+            '\t\tK: Autotune gains\n'
+            '\tL: Get autotune report'
+            '\t\tM: Get RAM usage per mode\n'
+            '\tN: Read back trajectory'
+            '\t\tO: Get overrun counters\n'
+            '\tP: Set overrun policy'
+            '\t\tT: Arm triggered capture\n'
+            '\tU: Force capture trigger'
+            '\t\tV: Upload capture\n'
+            '\tW: Get power and energy\n'
         )
 
         # Read the user's choice
@@ -59,6 +135,16 @@ def main():
 
         # Take the appropriate action
         match selection:
+            case 'a': # Load time-optimal trajectory
+                ref = input_optimal_trajectory()
+                t = range(len(ref))    # Display time-optimal trajectory
+                plt.plot(t,ref,'r*-')
+                plt.ylabel('Reference Motor Position')
+                plt.xlabel('Sample Count')
+                plt.show()
+                ser.write((str(len(ref))+'\n').encode())    # Send trajectory to PIC
+                for i in ref:
+                    ser.write((str(i)+'\n').encode())
             case 'b': # Read current (mA)
                 a_str = ser.read_until(b'\n') # Read current sensor
                 a_flt = float(a_str) # turn it into a float
@@ -68,9 +154,9 @@ def main():
                 n_int = int(n_str) # turn it into an int
                 print(f'Encoder count (counts): {n_int}\n') # print it to the screen
             case 'd': # Read encoder (degrees)
-                n_str = ser.read_until(b'\n') # Read encoder count from PIC
-                n_int = int(n_str) # turn it into an int
-                print(f'Encoder count (degrees): {n_int}\n') # print it to the screen
+                n_str = ser.read_until(b'\n') # Read encoder angle from PIC
+                n_flt = float(n_str) # turn it into a float
+                print(f'Encoder angle (degrees): {n_flt}\n') # print it to the screen
             case 'e': # Reset encoder
                 print('Reseting motor encoder...\n')
             case 'f': # Set PWM (-100 to 100)
@@ -108,7 +194,8 @@ def main():
                 kd_pos_out = ser.read_until(b'\n') 
                 print(f'Kp={float(kp_pos_out)}, Ki={float(ki_pos_out)}, Kd={float(kd_pos_out)}\n')
             case 'k': # Test current gains
-                plot_itest(ser)
+                columns, score = plot_itest(ser)
+                log.log_run('ITEST', columns, read_gains(), score)
             case 'l': # Go to angle (deg)
                 ang_selection = input('ENTER DESIRED ANGLE: ')
                 ang_selection = ang_selection+'\n'
@@ -134,7 +221,10 @@ def main():
                 for i in ref:
                     ser.write((str(i)+'\n').encode()) 
             case 'o': # Execute trajectory
-                plot_trajectory(ser)
+                run = plot_trajectory(ser)
+                if run is not None:
+                    columns, score = run
+                    log.log_run('TRACK', columns, read_gains(), score)
             case 'p': # Unpower the motor
                 print('Powering down motor...\n')
             case 'q': # Quit client
@@ -142,10 +232,166 @@ def main():
                 has_quit = True # Exit client
                 ser.close() # Close the port
             case 'r': # Get mode
-                modes = {0:'IDLE', 1:'PWM', 2:'ITEST', 3:'HOLD', 4:'TRACK'}
                 n_str = ser.read_until(b'\n') # Read mode from PIC
                 n_int = int(n_str)
-                print(f'Mode: {modes[n_int]}\n')
+                print(f'Mode: {MODES[n_int]}\n')
+            case 's': # Get run metrics
+                print_metrics('Current loop (ITEST)', read_metrics(ser), 'mA')
+                print_metrics('Position loop (TRACK)', read_metrics(ser), 'deg')
+            case 'v': # Current loop frequency response
+                fmin = input('ENTER START FREQUENCY (Hz): ')
+                fmax = input('ENTER END FREQUENCY (Hz, max 1250): ')
+                nbins = input('ENTER NUMBER OF BINS (max 32): ')
+                amp = input('ENTER AMPLITUDE (mA): ')
+                for val in (fmin, fmax, nbins, amp):
+                    ser.write((val+'\n').encode()) # Send sweep to PIC
+                plot_bode(ser)
+            case 'w': # Get fault status
+                faults = {0:'NONE', 1:'OVERCURRENT', 2:'I2T', 3:'STALL'}
+                data = ser.read_until(b'\n').split() # [code, last_us, max_us, trips]
+                print(f'Fault: {faults[int(data[0])]}, trips={int(data[3])}')
+                print(f'Shutdown latency: last={float(data[1]):.1f} us, max={float(data[2]):.1f} us\n')
+            case 'x': # Clear fault
+                print('Clearing fault...\n')
+            case 'y': # Set protection limits
+                inst = input('ENTER INSTANTANEOUS CURRENT LIMIT (mA): ')
+                rms = input('ENTER I2T RMS CURRENT LIMIT (mA): ')
+                stall = input('ENTER STALL CURRENT (mA): ')
+                stall_ms = input('ENTER STALL TIME (ms, 0 disables): ')
+                for val in (inst, rms, stall, stall_ms):
+                    ser.write((val+'\n').encode()) # Send limits to PIC
+            case 'z': # Stream sine setpoints
+                amp = float(input('ENTER AMPLITUDE (deg): '))
+                freq = float(input('ENTER FREQUENCY (Hz): '))
+                duration = float(input('ENTER DURATION (s): '))
+                rate = float(input('ENTER SETPOINT RATE (Hz, max 200): '))
+                delay = float(input('ENTER PLAYOUT DELAY (ms): '))
+                stats = stream_setpoints(ser, lambda t: amp*sin(2*pi*freq*t), duration, rate, delay)
+                print(f'Sent {stats["packets"]} setpoints, {stats["late"]} late, {stats["overflows"]} dropped')
+                print(f'Underruns: {stats["underruns"]} ({stats["underrun_ms"]} ms)')
+                print(f'Playout slack: mean={stats["mean_slack_ms"]:.1f} ms, min={stats["min_slack_ms"]} ms')
+                print(f'Latency: {stats["latency_ms"]:.1f} ms (delay={stats["delay_ms"]} ms, '
+                      f'link round trip={stats["rtt_ms"]:.1f} ms)\n')
+            case 'A': # Queue go to angle
+                ang = input('ENTER DESIRED ANGLE (deg): ')
+                duration = input('ENTER MOVE TIME (ms): ')
+                ser.write((ang+'\n').encode()) # Send segment to PIC
+                ser.write((duration+'\n').encode())
+            case 'B': # Queue via-point trajectory
+                refs_str = input('Enter times (ms, after the previous segment) and angles: ')
+                reflist = refs_str.split() # [t1, a1, ..., tn, an]
+                ser.write(f'{len(reflist)//2}\n'.encode()) # Send via points to PIC
+                for i in range(0, len(reflist)-1, 2):
+                    ser.write(f'{int(float(reflist[i]))} {reflist[i+1]}\n'.encode())
+            case 'C': # Queue dwell
+                duration = input('ENTER DWELL TIME (ms): ')
+                ser.write((duration+'\n').encode()) # Send segment to PIC
+            case 'D': # Get queue status
+                data = ser.read_until(b'\n').split() # [depth, completed]
+                print(f'Queued segments: {int(data[0])}, completed: {int(data[1])}\n')
+            case 'E': # Execute queue
+                print('Executing motion queue...\n')
+            case 'F': # Set feedforward model
+                path = input('ENTER MOTOR PARAMETER FILE (blank disables): ')
+                if path:
+                    with open(path) as f:
+                        params = json.load(f) # Exported by motor_id.py
+                    model = [params['J_kgm2'] or 0, params['b_Nms_per_rad'] or 0,
+                             params['c_Nm'] or 0, params['Kt_Nm_per_A']]
+                else:
+                    model = [0, 0, 0, 0]
+                for val in model:
+                    ser.write(f'{val}\n'.encode()) # Send model to PIC
+            case 'G': # Set measurement filter
+                lines = input_filter()
+                if lines is None:
+                    lines = ['-1 0 0 0'] # Rejected by the PIC, leaves the filter unchanged
+                for line in lines:
+                    ser.write((line+'\n').encode()) # Send filter to PIC
+            case 'H': # Get filter costs
+                print_filter_costs(ser)
+            case 'K': # Autotune gains
+                rule = input('ENTER RULE (0 ZN PID, 1 ZN PI, 2 Tyreus-Luyben PID, 3 no overshoot PID): ')
+                curr_relay = input('ENTER CURRENT RELAY AMPLITUDE (% duty) [20]: ') or '20'
+                curr_hyst = input('ENTER CURRENT RELAY HYSTERESIS (mA) [5]: ') or '5'
+                pos_relay = input('ENTER POSITION RELAY AMPLITUDE (mA) [100]: ') or '100'
+                ser.write(f'{rule} {curr_relay} {curr_hyst} {pos_relay}\n'.encode()) # Start autotune
+                print('Autotuning...')
+                while True:
+                    time.sleep(0.25)
+                    ser.write(b'L\n')
+                    report = read_autotune(ser)
+                    if report['phase'] not in ('CURRENT', 'POSITION'):
+                        break
+                print_autotune(report)
+            case 'L': # Get autotune report
+                print_autotune(read_autotune(ser))
+            case 'M': # Get RAM usage per mode
+                data = ser.read_until(b'\n').split() # [arena bytes, owner, bytes in use]
+                print(f'Arena: {int(data[0])} bytes, owner {MODES[int(data[1])]}, {int(data[2])} bytes in use')
+                for name in MODES:
+                    peak = int(ser.read_until(b'\n'))
+                    if peak > 0:
+                        print(f'\t{name}: {peak} bytes')
+                print()
+            case 'N': # Read back trajectory
+                n = int(ser.read_until(b'\n'))
+                ref = [float(ser.read_until(b'\n')) for _ in range(n)]
+                print(f'Loaded trajectory: {n} samples\n')
+                if n > 0:
+                    plt.plot(range(n),ref,'r*-')
+                    plt.ylabel('Reference Motor Position')
+                    plt.xlabel('Sample Count')
+                    plt.show()
+            case 'O': # Get overrun counters
+                policies = ['COUNT', 'DEGRADE', 'IDLE']
+                data = ser.read_until(b'\n').split() # [rate, policy, threshold, max_us, degrades]
+                print(f'Current loop rate: {int(data[0])} Hz, policy {policies[int(data[1])]} '
+                      f'after {int(data[2])} overruns, acted {int(data[4])} times')
+                print(f'Longest tick: {float(data[3]):.1f} us')
+                for name in MODES:
+                    counts = ser.read_until(b'\n').split() # [overruns, missed ticks]
+                    if int(counts[0]) or int(counts[1]):
+                        print(f'\t{name}: {int(counts[0])} overruns, {int(counts[1])} missed ticks')
+                print()
+            case 'P': # Set overrun policy
+                policy = input('ENTER POLICY (0 count only, 1 degrade rate, 2 idle): ')
+                threshold = input('ENTER OVERRUNS PER 1000 TICKS THAT TRIGGER IT: ')
+                ser.write((policy+'\n').encode()) # Send policy to PIC
+                ser.write((threshold+'\n').encode())
+            case 'T': # Arm triggered capture
+                trigger = input('ENTER TRIGGER (0 host, 1 current error, 2 position error, 3 current, 4 mode change): ')
+                level = input('ENTER LEVEL (mA or counts, unused for 0 and 4): ') or '0'
+                post = input('ENTER POST-TRIGGER SAMPLES (of 1024): ')
+                decimation = input('ENTER DECIMATION (ticks per sample): ') or '1'
+                ser.write(f'{trigger} {level} {post} {decimation}\n'.encode()) # Send trigger to PIC
+            case 'U': # Force capture trigger
+                print('Capture triggered\n')
+            case 'V': # Upload capture
+                result = plot_capture(ser)
+                if result is not None:
+                    columns, info = result
+                    log.log_run('CAPTURE', columns, read_gains(), metrics=info)
+            case 'W': # Get power and energy
+                bus = float(ser.read_until(b'\n'))
+                print(f'Bus voltage: {bus:.2f} V')
+                for name in ('Current run', 'Last run'):
+                    data = ser.read_until(b'\n').split() # [mode, s, mJ, peak mW, avg mW]
+                    if float(data[1]) > 0:
+                        print(f'{name} ({MODES[int(data[0])]}): {float(data[1]):.2f} s, '
+                              f'{float(data[2])/1000:.3f} J, peak {float(data[3]):.0f} mW, '
+                              f'average {float(data[4]):.0f} mW')
+                    else:
+                        print(f'{name}: none')
+                print()
+            case 't': # Execute trajectory (metrics only)
+                metrics = read_metrics(ser)
+                print_metrics('Position loop (TRACK)', metrics, 'deg')
+                log.log_run('TRACK', gains=read_gains(), score=metrics['mae'], metrics=metrics)
+            case 'u': # Test current gains (metrics only)
+                metrics = read_metrics(ser)
+                print_metrics('Current loop (ITEST)', metrics, 'mA')
+                log.log_run('ITEST', gains=read_gains(), score=metrics['mae'], metrics=metrics)
             case _: # Default case, invalid selection
                 print(f'Invalid Selection: {selection_endline}')
 
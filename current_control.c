@@ -11,6 +11,19 @@
 #include "current_control.h"
 #include "ina219.h"
 #include "utilities.h"
+#include "metrics.h"
+#include "freq_response.h"
+#include "protection.h"
+#include "arena.h"
+#include "scheduler.h"
+#include "feedforward.h"
+#include "filter.h"
+#include "power.h"
+#include "capture.h"
+#include "position_control.h"
+#include "autotune.h"
+
+#define ITEST_STEP_JUMP 50.0f   // Move between reference plateaus (mA) treated as a step
 
 static volatile int PwmDC = 0; // PWM duty cycle
 static volatile int PwmDirection = 0;  // PWM direction (0 for forward, 1 for reverse)
@@ -20,43 +33,97 @@ static volatile float Eint = 0;               // Integral of error
 
 static volatile float Torque = 0;               // Desired torque from position controller
 
-static volatile float ITEST_Waveform[ITEST_NUMSAMPS];     // Waveform
-static volatile float CURRarray[ITEST_NUMSAMPS];      // Measured values to plot (from current sensor)
-static volatile float REFarray[ITEST_NUMSAMPS];      // Reference values to plot (ref current);
+// Borrowed from the arena by start_itest()
+static volatile float *ITEST_Waveform;     // Waveform
+static volatile float *CURRarray;      // Measured values to plot (from current sensor)
+static volatile float *REFarray;      // Reference values to plot (ref current);
+static volatile float *DUTYarray;     // Applied duty cycle to plot (%)
+static volatile float MeasCurrent = 0;              // Last measured current (mA)
+static float FilteredCurrent = 0;   // Last filtered current (mA), held on bus voltage ticks
+static int CurrentFresh = 0;        // This tick's INA219 read measured the current
+static Metrics ItestMetrics;                        // Tracking metrics of the last ITEST
 
 // char m[50];
 // sprintf(m,"%d\r\n",OC1RS);
 // NU32DIP_WriteUART1(m);
 
-void __ISR(_TIMER_3_VECTOR, IPL6SOFT) CurrentController(void) {
+//
+// Read the current sensor (mA), and the bus voltage every
+// POWER_BUS_DECIMATION ticks. Protection sees the raw reading and the
+// controller the filtered one. A bus voltage tick measures no current, so
+// the last filtered value is held and the filters and protection skip it.
+//
+static float read_current(void) {
+    INA219_Sample sample;
+    INA219_read_sample(&sample, power_bus_due());   // One I2C transaction per tick
+    if (sample.bus_fresh) {
+        power_set_bus(sample.bus);
+    }
+    CurrentFresh = sample.current_fresh;
+    if (CurrentFresh) {
+        int raw = sample.current;
+        protection_check_current(raw / INA219_LSB_PER_MA);
+        FilteredCurrent = filter_sample(FILT_CURRENT, raw) / INA219_LSB_PER_MA;
+    }
+    return FilteredCurrent;
+}
+
+//
+// Filtered derivative of the current error (mA per tick), held on ticks
+// that measured no current
+//
+static float error_derivative(float error) {
+    if (!CurrentFresh) {
+        return filter_skip(FILT_CURRENT) / INA219_LSB_PER_MA;
+    }
+    return filter_derivative(FILT_CURRENT, (int) (error * INA219_LSB_PER_MA)) / INA219_LSB_PER_MA;
+}
+
+//
+// Current loop update, called by the scheduler every tick
+//
+void current_control_tick(void) {
     // OC1RS = 600; // Set duty cycle to 25%
     // LATBINV = 0x800;    // Toggle RB11
     static int itest_samples = 0;
     static float current = 0;
+    static float ref = 0;         // Current reference (mA)
     static float error = 0;
-    static float prev_error = 0;
     static float u = 0;           // Control signal
 
+    autotune_watch(get_mode());     // Restores the gains if AUTOTUNE was cut short
+
     switch (get_mode()) {
         case IDLE:
         {
             OC1RS = 0; // Set duty cycle to 0%
+            current = 0;   // Not measured
+            ref = 0;
+            filter_reset(FILT_CURRENT);
+            FilteredCurrent = 0;
+            protection_check_current(0);    // Let I^2t cool down
             break;
         }
         case PWM:
         {
             OC1RS = PwmDC; // Set duty cycle to duty cycle
             LATBbits.LATB11 = PwmDirection; // Set motor direction
+            current = read_current();   // Only for protection and telemetry
+            ref = 0;    // Open loop
             break;
         }
         case ITEST:
         {
             itest_samples++;
+            if (itest_samples == 1) {
+                metrics_reset(&ItestMetrics, ITEST_STEP_JUMP, 0);  // Motor is unpowered before the test
+            }
 
-            current = INA219_read_current();  // Read current sensor
-            error = (float) ITEST_Waveform[itest_samples] - current;  // Calculate error
+            current = read_current();  // Read current sensor
+            ref = ITEST_Waveform[itest_samples];
+            error = ref - current;  // Calculate error
             Eint += error;  // Update integral of error
-            u = Kp*error + Ki*Eint + Kd*(error - prev_error);  // Calculate control signal
+            u = Kp*error + Ki*Eint + Kd*error_derivative(error);  // Calculate control signal
 
             if (Eint > 150.0f) {    // Prevent integrator wind up
                 Eint = 150.0f; 
@@ -75,25 +142,25 @@ void __ISR(_TIMER_3_VECTOR, IPL6SOFT) CurrentController(void) {
             // Save points to plot later
             CURRarray[itest_samples] = current;
             REFarray[itest_samples] = ITEST_Waveform[itest_samples];
+            DUTYarray[itest_samples] = get_duty() * 100.0f / 2400.0f;
+            metrics_update(&ItestMetrics, ITEST_Waveform[itest_samples], current);
 
             // If we are done testing set mode to IDLE
             if (itest_samples >= ITEST_NUMSAMPS - 1) {
+                metrics_finish(&ItestMetrics);
                 set_mode(IDLE);
                 itest_samples = 0;
                 Eint = 0;
             }
             break;
         }
-        case HOLD:
+        case FRESP:
         {
-            current = INA219_read_current();   // Calculate necessary current for desired torque
-            error = (float) Torque - current;  // Calculate error
+            ref = fresp_reference();     // Sine excitation for this bin
+            current = read_current();
+            error = ref - current;  // Calculate error
             Eint += error;  // Update integral of error
-            u = Kp*error + Ki*Eint + Kd*(error - prev_error);  // Calculate control signal
-
-            // char m[50]; // Debug output
-            // sprintf(m,"%f\r\n",Torque);
-            // NU32DIP_WriteUART1(m);
+            u = Kp*error + Ki*Eint + Kd*error_derivative(error);  // Calculate control signal
 
             if (Eint > 150.0f) {    // Prevent integrator wind up
                 Eint = 150.0f; 
@@ -104,13 +171,37 @@ void __ISR(_TIMER_3_VECTOR, IPL6SOFT) CurrentController(void) {
             set_pwm_dc(u);  // Set the duty cycle and direction bit
             OC1RS = PwmDC;
             LATBbits.LATB11 = PwmDirection;
+
+            // Correlate reference, response and applied duty (%) for this bin
+            float duty = (PwmDirection ? -PwmDC : PwmDC) * 100.0f / 2400.0f;
+            if (fresp_advance(current, duty)) {
+                set_mode(IDLE);
+                Eint = 0;
+            }
+            break;
+        }
+        case AUTOTUNE:
+        {
+            if (autotune_current_phase()) {
+                current = read_current();
+                ref = 0;
+                set_pwm_dc(autotune_current_tick(current));    // Relay replaces the controller
+                OC1RS = PwmDC;
+                LATBbits.LATB11 = PwmDirection;
+                break;
+            }
+            // Position experiment, the current loop runs as in HOLD
         }
+        case HOLD:
         case TRACK:
+        case STREAM:
+        case QUEUE:
         {
-            current = INA219_read_current();   // Calculate necessary current for desired torque
-            error = (float) Torque - current;  // Calculate error
+            current = read_current();   // Calculate necessary current for desired torque
+            ref = Torque + feedforward_sample();   // PID torque plus model feedforward
+            error = ref - current;  // Calculate error
             Eint += error;  // Update integral of error
-            u = Kp*error + Ki*Eint + Kd*(error - prev_error);  // Calculate control signal
+            u = Kp*error + Ki*Eint + Kd*error_derivative(error);  // Calculate control signal
 
             // char m[50]; // Debug output
             // sprintf(m,"%f\r\n",Torque);
@@ -125,6 +216,7 @@ void __ISR(_TIMER_3_VECTOR, IPL6SOFT) CurrentController(void) {
             set_pwm_dc(u);  // Set the duty cycle and direction bit
             OC1RS = PwmDC;
             LATBbits.LATB11 = PwmDirection;
+            break;
         }
         default:
         {
@@ -133,22 +225,30 @@ void __ISR(_TIMER_3_VECTOR, IPL6SOFT) CurrentController(void) {
         }
     }
 
+    MeasCurrent = current;
+    power_update(get_mode(), current);
 
-    IFS0bits.T3IF = 0;  // Clear interrupt flag
+    // A fault overrides whatever the mode wrote this tick
+    if (protection_tripped()) {
+        OC1RS = 0;
+        protection_shutdown_done();
+        itest_samples = 0;
+        Eint = 0;
+    }
+
+    capture_sample(get_mode(), current, ref, get_duty(), get_position(), get_angle());
 }
 
 //
-// Initialize SFRs for 5kHz current control ISR and
-// 20 kHz PWM signal
+// Initialize SFRs for 20 kHz PWM signal. The current loop
+// itself is run by the scheduler.
 //
 void Current_Control_Startup(void) {
     __builtin_disable_interrupts();
     pwm_setup();
-    current_controller_setup();
     TRISBbits.TRISB11 = 0; // Set RB11 as output for motor direction
     T2CONbits.ON = 1; // turn on Timer2 (PWM)
     OC1CONbits.ON = 1; // turn on OC1
-    T3CONbits.ON = 1; // turn on Timer3 (Current Controller)
     __builtin_enable_interrupts();
 }
 
@@ -177,23 +277,23 @@ static void pwm_setup(void) {
 }
 
 //
-// Setup SFRs for 5kHz current control using Timer3
+// Borrow the ITEST buffers, build the waveform and start the test.
+// Returns 0 if the arena is busy or a latched fault refuses the mode.
 //
-static void current_controller_setup(void) {
-    //
-    // Timer3 settings (Current Control ISR)
-    //
-    T3CONbits.TCKPS = 0; // Timer3 prescaler N=1
-    PR3 = 9599; // period = (PR3+1) * N * 20.83 ns = 0.2 ms, 5 kHz
-    TMR3 = 0; // initialize TMR3 count
-
-    // Initialize Timer3 ISR
-    IPC3bits.T3IP = 6;            // interrupt priority 6
-    IPC3bits.T3IS = 0;            // subpriority 0
-    IFS0bits.T3IF = 0;            // clear the int flag
-    IEC0bits.T3IE = 1;            // enable Timer3
-
-    return;
+int start_itest() {
+    if (!arena_acquire(ITEST)) {
+        return 0;
+    }
+    ITEST_Waveform = arena_alloc(ITEST_NUMSAMPS * sizeof(float));
+    CURRarray = arena_alloc(ITEST_NUMSAMPS * sizeof(float));
+    REFarray = arena_alloc(ITEST_NUMSAMPS * sizeof(float));
+    DUTYarray = arena_alloc(ITEST_NUMSAMPS * sizeof(float));
+    if (!ITEST_Waveform || !CURRarray || !REFarray || !DUTYarray) {
+        return 0;
+    }
+    make_waveform();
+    set_mode(ITEST);
+    return get_mode() == ITEST;
 }
 
 //
@@ -213,13 +313,26 @@ void make_waveform() {
     }
 }
 
+//
+// Send ITEST metrics summary to Python
+//
+void send_curr_metrics() {
+    char message[100];
+    metrics_sprint(message, &ItestMetrics, 1.0f, 1000.0f / scheduler_rate());
+    NU32DIP_WriteUART1(message);
+}
+
 //
 // Send plot data to Python
 //
 void send_curr_data() {
-    char message[50];
+    char message[80];
+    if (arena_owner() != ITEST) {
+        NU32DIP_WriteUART1("1 0 0\r\n");  // Buffers were reclaimed, send an empty last line
+        return;
+    }
     for (int i=0; i<ITEST_NUMSAMPS; i++) {  // Send plot data
-        sprintf(message, "%d %f %f\r\n", ITEST_NUMSAMPS-i, CURRarray[i], REFarray[i]);
+        sprintf(message, "%d %f %f %.1f\r\n", ITEST_NUMSAMPS-i, CURRarray[i], REFarray[i], DUTYarray[i]);
         NU32DIP_WriteUART1(message);
     }
 }
@@ -254,6 +367,13 @@ void set_pwm_dc(int dc) {
 //
 float set_torque(float tor) { Torque = tor; }
 
+//
+// Getters for the last measured current (mA) and the duty cycle
+// being applied, signed OC1RS counts (+/-2400 = +/-100%)
+//
+float get_current() { return MeasCurrent; }
+int get_duty() { return LATBbits.LATB11 ? -(int) OC1RS : (int) OC1RS; }
+
 //
 // Setters for current control gains
 //
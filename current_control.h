@@ -9,12 +9,16 @@ void set_curr_kd(float kd);
 float get_curr_kp();
 float get_curr_ki();
 float get_curr_kd();
+float get_current();
+int get_duty();
 
 void Current_Control_Startup(void);
+void current_control_tick(void);
 static void pwm_setup(void);
-static void current_controller_setup(void);
+int start_itest();
 void make_waveform();
 void send_curr_data();
+void send_curr_metrics();
 
 
 #endif // CURRENT_CONTROL__H__
\ No newline at end of file
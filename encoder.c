@@ -10,6 +10,7 @@
 
 #define UART2_DESIRED_BAUD 230400
 #define MAX_RX_MESSAGE 100
+#define ENCODER_TIMEOUT 2400  // Core ticks (100 us) to wait for a prefetched count
 
 volatile int rx_num_bytes = 0;
 char rx_message[MAX_RX_MESSAGE];
@@ -32,18 +33,56 @@ int get_encoder_count(){
 }
 
 //
-// Read motor encoder in degrees
+// Read motor encoder in raw counts
 //
-int read_encoder_deg() {
+int read_encoder_counts() {
   WriteUART2("a");
   while(!get_encoder_flag()) {
       ;
   }
   set_encoder_flag(0);
-  int p = get_encoder_count();
-  int degrees = (int) ((float) p / 3.7111);
+  return get_encoder_count();
+}
+
+//
+// Ask the Pico for a count without waiting for the reply. Used by
+// the scheduler a few ticks before the position loop needs it.
+//
+void request_encoder_count() {
+  set_encoder_flag(0);
+  WriteUART2("a");
+}
+
+//
+// Collect a count started by request_encoder_count(). Waits briefly if
+// the reply is late, then falls back to the last count received.
+//
+int collect_encoder_count() {
+  unsigned int start = _CP0_GET_COUNT();
+  while(!get_encoder_flag() && (_CP0_GET_COUNT() - start) < ENCODER_TIMEOUT) {
+      ;
+  }
+  set_encoder_flag(0);
+  return get_encoder_count();
+}
+
+//
+// Fixed-point conversions between encoder counts and centidegrees.
+// Only used at the client boundary; the control loops work in counts.
+//
+int cdeg_to_counts(int cdeg) {
+  long long q = (long long) cdeg * ENC_COUNTS_PER_CDEG_Q24;
+  return (int) ((q + (1 << 23)) >> 24);
+}
+
+int deg_to_counts(float deg) {
+  int cdeg = (int) (deg * 100.0f + ((deg < 0) ? -0.5f : 0.5f));
+  return cdeg_to_counts(cdeg);
+}
 
-  return degrees;
+int counts_to_cdeg(int counts) {
+  long long q = (long long) counts * ENC_CDEG_PER_COUNT_Q16;
+  return (int) ((q + (1 << 15)) >> 16);
 }
 
 void __ISR(_UART_2_VECTOR, IPL7SOFT) U2ISR(void) { 
@@ -6,11 +6,20 @@
 
 #include "NU32DIP.h"
 
+#define ENC_COUNTS_PER_DEG 3.7111f            // Encoder resolution (counts per degree)
+#define ENC_COUNTS_PER_CDEG_Q24 622619         // round(3.7111/100 * 2^24), centidegrees -> counts
+#define ENC_CDEG_PER_COUNT_Q16 1765945         // round(100/3.7111 * 2^16), counts -> centidegrees
+
 void UART2_Startup();
 void WriteUART2(const char * string);
 int get_encoder_flag();
 void set_encoder_flag();
 int get_encoder_count();
-int read_encoder_deg();
+int read_encoder_counts();
+void request_encoder_count();
+int collect_encoder_count();
+int cdeg_to_counts(int cdeg);
+int deg_to_counts(float deg);
+int counts_to_cdeg(int counts);
 
 #endif // ENCODER__H__
@@ -0,0 +1,118 @@
+// feedforward.c
+//
+// This file contains the model-based torque feedforward. The position loop
+// hands it the reference around each update, and it computes the current
+// needed to follow it from the motor model
+//
+//   Kt*i = J*dw/dt + b*w + c*sign(w)
+//
+// The current loop adds it to the PID torque, ramping linearly between
+// position updates instead of holding it for a whole period.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include <stdlib.h>
+#include "nu32dip.h"
+#include "feedforward.h"
+#include "encoder.h"
+#include "scheduler.h"
+#include "utilities.h"
+
+#define RAD_PER_COUNT (3.14159265f / 180.0f / ENC_COUNTS_PER_DEG)
+#define FF_STEP_JUMP 19                     // Reference change per update (counts, ~5 deg) treated as a step
+
+// Model scaled to mA per reference difference (counts), 0 = disabled
+static volatile float KJ = 0;       // Per second difference, (n - 2r + p)
+static volatile float Kb = 0;       // Per central difference, (n - p)
+static volatile float Kc = 0;       // Coulomb friction (mA)
+
+static volatile int Hist[2] = {0, 0};   // Last two references seen (counts)
+static volatile float FfNow = 0;        // Feedforward current this tick (mA)
+static volatile float FfStep = 0;       // Change per current loop tick (mA)
+static volatile int RampTicks = 0;      // Ticks left in the ramp
+
+//
+// Plan the ramp toward the feedforward for ref, given its neighbouring
+// references one position period either side. The ramp reaches it one
+// period from now, so callers that can look ahead should pass the
+// reference for the next update. A step in the references is not a
+// motion the model can follow, so across one the feedforward ramps to
+// zero and the PID makes the move.
+//
+void feedforward_update(int prev, int ref, int next) {
+    Hist[0] = ref;
+    Hist[1] = next;
+    if (KJ == 0 && Kb == 0 && Kc == 0) {
+        FfNow = 0;
+        RampTicks = 0;
+        return;
+    }
+
+    float target = 0;
+    if (abs(next - ref) <= FF_STEP_JUMP && abs(ref - prev) <= FF_STEP_JUMP) {
+        int vel = next - prev;
+        target = KJ*(next - 2*ref + prev) + Kb*vel;
+        if (vel > 0) {
+            target += Kc;
+        } else if (vel < 0) {
+            target -= Kc;
+        }
+    }
+
+    int ticks = scheduler_rate() / POSITION_LOOP_HZ;
+    FfStep = (target - FfNow) / ticks;
+    RampTicks = ticks;
+}
+
+//
+// Plan the ramp from the newest reference alone, for modes that cannot
+// look ahead. The derivatives are centred on the previous reference.
+//
+void feedforward_push(int ref) {
+    feedforward_update(Hist[0], Hist[1], ref);
+}
+
+//
+// Drop the feedforward and restart the reference history at ref
+//
+void feedforward_reset(int ref) {
+    Hist[0] = ref;
+    Hist[1] = ref;
+    FfNow = 0;
+    FfStep = 0;
+    RampTicks = 0;
+}
+
+//
+// Feedforward current for this tick (mA), called by the current loop
+//
+float feedforward_sample(void) {
+    if (RampTicks > 0) {
+        FfNow += FfStep;
+        RampTicks--;
+    }
+    return FfNow;
+}
+
+//
+// Set the motor model in SI units (kg*m^2, N*m*s/rad, N*m, N*m/A), as
+// exported by motor_id.py. Kt <= 0 disables the feedforward.
+//
+void set_feedforward(float J, float b, float c, float Kt) {
+    __builtin_disable_interrupts();
+    if (Kt > 0) {
+        float hz = POSITION_LOOP_HZ;
+        KJ = 1000.0f * J / Kt * RAD_PER_COUNT * hz * hz;
+        Kb = 1000.0f * b / Kt * RAD_PER_COUNT * hz / 2.0f;
+        Kc = 1000.0f * c / Kt;
+    } else {
+        KJ = 0;
+        Kb = 0;
+        Kc = 0;
+    }
+    FfNow = 0;
+    FfStep = 0;
+    RampTicks = 0;
+    __builtin_enable_interrupts();
+}
@@ -0,0 +1,11 @@
+#ifndef FEEDFORWARD__H__
+#define FEEDFORWARD__H__
+
+void feedforward_update(int prev, int ref, int next);
+void feedforward_push(int ref);
+void feedforward_reset(int ref);
+float feedforward_sample(void);
+
+void set_feedforward(float J, float b, float c, float Kt);
+
+#endif // FEEDFORWARD__H__
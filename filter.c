@@ -0,0 +1,205 @@
+// filter.c
+//
+// This file contains the fixed-point filter pipeline on the measurement
+// path. Each channel runs an optional median-of-3 spike rejector and up to
+// FILTER_MAX_BIQUADS biquad sections (Q30 coefficients, direct form I with
+// a 64-bit accumulator and error feedback), and provides a low-pass filtered derivative for
+// the D terms. Every stage is timed with the core timer so its cost can be
+// checked against the tick budget.
+//
+// Author: Jared Berry
+//
+#include "nu32dip.h"
+#include "filter.h"
+
+#define FILTER_ONE (1 << FILTER_Q)
+#define FILTER_ROUND (1 << (FILTER_Q - 1))
+#define BIQUAD_ONE (1LL << FILTER_BIQUAD_Q)
+#define CORE_TICKS_PER_US 24                 // Core timer runs at SYSCLK/2
+
+typedef struct {
+    int b0, b1, b2, a1, a2;     // Q30, a0 normalised to 1. Q14 was too coarse for low cutoffs.
+    int x1, x2, y1, y2;         // Direct form I state
+    int err;                    // Truncation remainder fed back into the next sample
+} Biquad;
+
+typedef struct {
+    int median;                 // Non-zero enables median-of-3
+    int nbiquads;               // Biquad sections in use
+    Biquad bq[FILTER_MAX_BIQUADS];
+    short alpha;                // Derivative low-pass, Q14 (FILTER_ONE = raw difference)
+
+    int primed;                 // State initialised from the first sample
+    int m1, m2;                 // Last two raw inputs, for the median
+    int deriv_primed;
+    int deriv_prev;             // Previous derivative input
+    int deriv_gap;              // Samples since deriv_prev, more than 1 after filter_skip()
+    int deriv;                  // Filtered derivative, Q14
+
+    unsigned int cost_last[FILT_NUM_STAGES];   // Core ticks
+    unsigned int cost_max[FILT_NUM_STAGES];
+} FilterChain;
+
+static volatile FilterChain Chains[FILT_NUM_CHANNELS] = {
+    { .alpha = FILTER_ONE },
+    { .alpha = FILTER_ONE },
+};
+
+static void record_cost(volatile FilterChain *f, FilterStage s, unsigned int ticks) {
+    f->cost_last[s] = ticks;
+    if (ticks > f->cost_max[s]) {
+        f->cost_max[s] = ticks;
+    }
+}
+
+static int median3(int a, int b, int c) {
+    if (a > b) { int t = a; a = b; b = t; }
+    if (b > c) { b = c; }
+    return a > b ? a : b;
+}
+
+//
+// Run a biquad section. On the first sample the state is set to the
+// steady state for x, so enabling a filter on an offset signal such as
+// the encoder does not cause a transient. Each product is a single
+// 32x32 to 64-bit multiply.
+//
+static int biquad(volatile Biquad *q, int x, int prime) {
+    if (prime) {
+        long long den = BIQUAD_ONE + q->a1 + q->a2;
+        long long num = (long long) q->b0 + q->b1 + q->b2;
+        int y = den ? (int) (x * num / den) : x;
+        q->x1 = q->x2 = x;
+        q->y1 = q->y2 = y;
+        q->err = 0;
+    }
+    long long acc = (long long) q->b0 * x + (long long) q->b1 * q->x1 + (long long) q->b2 * q->x2
+                  - (long long) q->a1 * q->y1 - (long long) q->a2 * q->y2 + q->err;
+    int y = (int) (acc >> FILTER_BIQUAD_Q);
+    q->err = (int) (acc - ((long long) y << FILTER_BIQUAD_Q));   // Error feedback removes the deadband at low cutoffs
+    q->x2 = q->x1;
+    q->x1 = x;
+    q->y2 = q->y1;
+    q->y1 = y;
+    return y;
+}
+
+//
+// Filter one measurement through the channel's median and biquad stages
+//
+int filter_sample(FilterChannel ch, int x) {
+    volatile FilterChain *f = &Chains[ch];
+    int prime = !f->primed;
+    if (prime) {
+        f->m1 = f->m2 = x;
+        f->primed = 1;
+    }
+
+    unsigned int t0 = _CP0_GET_COUNT();
+    if (f->median) {
+        int raw = x;
+        x = median3(raw, f->m1, f->m2);
+        f->m2 = f->m1;
+        f->m1 = raw;
+    }
+    unsigned int t1 = _CP0_GET_COUNT();
+    for (int i = 0; i < f->nbiquads; i++) {
+        x = biquad(&f->bq[i], x, prime);
+    }
+    unsigned int t2 = _CP0_GET_COUNT();
+
+    record_cost(f, FILT_STAGE_MEDIAN, t1 - t0);
+    record_cost(f, FILT_STAGE_BIQUAD, t2 - t1);
+    return x;
+}
+
+//
+// Low-pass filtered first difference of x, per sample, in the units of x
+//
+int filter_derivative(FilterChannel ch, int x) {
+    volatile FilterChain *f = &Chains[ch];
+    unsigned int t0 = _CP0_GET_COUNT();
+    if (!f->deriv_primed) {
+        f->deriv_prev = x;
+        f->deriv = 0;
+        f->deriv_gap = 1;
+        f->deriv_primed = 1;
+    }
+    int diff = (x - f->deriv_prev) << FILTER_Q;
+    if (f->deriv_gap > 1) {
+        diff /= f->deriv_gap;   // Per sample, across skipped ones
+        f->deriv_gap = 1;
+    }
+    f->deriv += (int) (((long long) f->alpha * (diff - f->deriv)) >> FILTER_Q);
+    f->deriv_prev = x;
+    int d = (f->deriv + FILTER_ROUND) >> FILTER_Q;
+    record_cost(f, FILT_STAGE_DERIV, _CP0_GET_COUNT() - t0);
+    return d;
+}
+
+//
+// Skip a sample period with no new measurement. Returns the derivative
+// held from the last sample; the next difference is spread over the gap.
+//
+int filter_skip(FilterChannel ch) {
+    volatile FilterChain *f = &Chains[ch];
+    if (!f->deriv_primed) {
+        return 0;
+    }
+    f->deriv_gap++;
+    return (f->deriv + FILTER_ROUND) >> FILTER_Q;
+}
+
+//
+// Restart the channel's filter state from its next sample
+//
+void filter_reset(FilterChannel ch) {
+    Chains[ch].primed = 0;
+    Chains[ch].deriv_primed = 0;
+}
+
+//
+// Configure a channel. coeffs holds {b0, b1, b2, a1, a2} in Q30 for each
+// biquad section. deriv_alpha is the derivative low-pass coefficient in
+// Q14, FILTER_ONE for a raw difference. Clears the cost counters.
+//
+void set_filter(FilterChannel ch, int median, int nbiquads, const int coeffs[][5], short deriv_alpha) {
+    __builtin_disable_interrupts();
+    volatile FilterChain *f = &Chains[ch];
+    f->median = median;
+    f->nbiquads = nbiquads;
+    for (int i = 0; i < nbiquads; i++) {
+        f->bq[i].b0 = coeffs[i][0];
+        f->bq[i].b1 = coeffs[i][1];
+        f->bq[i].b2 = coeffs[i][2];
+        f->bq[i].a1 = coeffs[i][3];
+        f->bq[i].a2 = coeffs[i][4];
+    }
+    f->alpha = deriv_alpha;
+    f->primed = 0;
+    f->deriv_primed = 0;
+    for (int s = 0; s < FILT_NUM_STAGES; s++) {
+        f->cost_last[s] = 0;
+        f->cost_max[s] = 0;
+    }
+    __builtin_enable_interrupts();
+}
+
+//
+// Send the last and worst per-sample cost of each stage (us), one line
+// per channel
+//
+void send_filter_costs() {
+    char message[100];
+    for (int ch = 0; ch < FILT_NUM_CHANNELS; ch++) {
+        volatile FilterChain *f = &Chains[ch];
+        sprintf(message, "%f %f %f %f %f %f\r\n",
+                (float) f->cost_last[FILT_STAGE_MEDIAN] / CORE_TICKS_PER_US,
+                (float) f->cost_max[FILT_STAGE_MEDIAN] / CORE_TICKS_PER_US,
+                (float) f->cost_last[FILT_STAGE_BIQUAD] / CORE_TICKS_PER_US,
+                (float) f->cost_max[FILT_STAGE_BIQUAD] / CORE_TICKS_PER_US,
+                (float) f->cost_last[FILT_STAGE_DERIV] / CORE_TICKS_PER_US,
+                (float) f->cost_max[FILT_STAGE_DERIV] / CORE_TICKS_PER_US);
+        NU32DIP_WriteUART1(message);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef FILTER__H__
+#define FILTER__H__
+
+#define FILTER_MAX_BIQUADS 2        // Biquad sections per channel
+#define FILTER_Q 14                 // Derivative coefficient fraction bits, 16384 = 1.0
+#define FILTER_BIQUAD_Q 30          // Biquad coefficient fraction bits, 1 << 30 = 1.0
+
+typedef enum {
+    FILT_CURRENT,       // INA219 current (raw register LSBs), 5 kHz
+    FILT_POSITION,      // Encoder counts, 200 Hz
+    FILT_NUM_CHANNELS
+} FilterChannel;
+
+typedef enum {
+    FILT_STAGE_MEDIAN,
+    FILT_STAGE_BIQUAD,  // All biquad sections together
+    FILT_STAGE_DERIV,
+    FILT_NUM_STAGES
+} FilterStage;
+
+int filter_sample(FilterChannel ch, int x);
+int filter_derivative(FilterChannel ch, int x);
+int filter_skip(FilterChannel ch);
+void filter_reset(FilterChannel ch);
+
+void set_filter(FilterChannel ch, int median, int nbiquads, const int coeffs[][5], short deriv_alpha);
+void send_filter_costs();
+
+#endif // FILTER__H__
@@ -0,0 +1,168 @@
+// freq_response.c
+//
+// This file contains a stepped-sine frequency response test for the
+// current loop. Each bin is analysed on the fly with single-bin DFT
+// accumulators, so only the per-bin results are sent to the client.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include "nu32dip.h"
+#include "freq_response.h"
+#include "utilities.h"
+#include "arena.h"
+#include "scheduler.h"
+
+#define FRESP_CYCLES 4            // Whole cycles integrated per bin
+#define FRESP_SETTLE_CYCLES 2     // Cycles discarded per bin to let transients die out
+#define FRESP_PI 3.14159265f
+
+typedef struct {
+    float f;                      // Bin frequency (Hz), rounded to whole cycles
+    float cw, sw;                 // Per-sample phasor rotation
+    int settle;                   // Samples discarded before integrating
+    int n;                        // Samples integrated
+    float ref_re, ref_im;         // DFT of reference current
+    float cur_re, cur_im;         // DFT of measured current
+    float duty_re, duty_im;       // DFT of applied duty cycle
+} FrespBin;
+
+static FrespBin *Bins;                // Borrowed from the arena by fresp_setup()
+static volatile int NumBins = 0;
+static volatile int DoneBins = 0;     // Bins fully excited and integrated
+static volatile float Amplitude = 0;  // Excitation amplitude (mA)
+
+static int BinIndex = 0;              // Bin being excited
+static int BinSample = 0;             // Sample within the current bin
+static float OscC = 1, OscS = 0;      // Excitation phasor, cos and sin
+
+//
+// Plan a logarithmic sweep. Returns 0 if the request is invalid.
+//
+int fresp_setup(float fmin, float fmax, int nbins, float amplitude) {
+    float fs = scheduler_rate();    // Sample rate of the current loop
+    if (nbins < 1 || nbins > FRESP_MAXBINS || fmin <= 0 || fmax < fmin
+        || fmax > fs / 4.0f) {
+        return 0;
+    }
+    NumBins = 0;
+    DoneBins = 0;
+    if (!arena_acquire(FRESP) || !(Bins = arena_alloc(nbins * sizeof(FrespBin)))) {
+        return 0;
+    }
+
+    for (int i = 0; i < nbins; i++) {
+        float f = fmin;
+        if (nbins > 1) {
+            f = fmin * powf(fmax / fmin, (float) i / (nbins - 1));
+        }
+        // Round to a whole number of cycles so the DFT has no leakage
+        int n = (int) (FRESP_CYCLES * fs / f + 0.5f);
+        f = FRESP_CYCLES * fs / n;
+
+        Bins[i].f = f;
+        Bins[i].cw = cosf(2.0f * FRESP_PI * f / fs);
+        Bins[i].sw = sinf(2.0f * FRESP_PI * f / fs);
+        Bins[i].settle = n * FRESP_SETTLE_CYCLES / FRESP_CYCLES;
+        Bins[i].n = n;
+        Bins[i].ref_re = Bins[i].ref_im = 0;
+        Bins[i].cur_re = Bins[i].cur_im = 0;
+        Bins[i].duty_re = Bins[i].duty_im = 0;
+    }
+
+    NumBins = nbins;
+    Amplitude = amplitude;
+    BinIndex = 0;
+    BinSample = 0;
+    OscC = 1;
+    OscS = 0;
+    return 1;
+}
+
+//
+// Reference current (mA) for the present sample
+//
+float fresp_reference() {
+    return Amplitude * OscS;
+}
+
+//
+// Accumulate one sample and rotate the phasor. Returns 1 when the sweep is done.
+//
+int fresp_advance(float current, float duty) {
+    FrespBin *b = &Bins[BinIndex];
+
+    if (BinSample >= b->settle) {
+        float ref = Amplitude * OscS;
+        b->ref_re += ref * OscC;
+        b->ref_im -= ref * OscS;
+        b->cur_re += current * OscC;
+        b->cur_im -= current * OscS;
+        b->duty_re += duty * OscC;
+        b->duty_im -= duty * OscS;
+    }
+
+    // Rotate the phasor and renormalise to stop amplitude drift
+    float c = OscC * b->cw - OscS * b->sw;
+    float s = OscS * b->cw + OscC * b->sw;
+    float g = 1.5f - 0.5f * (c*c + s*s);
+    OscC = c * g;
+    OscS = s * g;
+
+    BinSample++;
+    if (BinSample >= b->settle + b->n) {
+        BinSample = 0;
+        BinIndex++;
+        DoneBins = BinIndex;
+        if (BinIndex >= NumBins) {
+            BinIndex = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// Wrap a phase difference into (-180, 180] degrees
+//
+static float wrap_deg(float rad) {
+    float deg = rad * 180.0f / FRESP_PI;
+    while (deg > 180.0f) {
+        deg -= 360.0f;
+    }
+    while (deg <= -180.0f) {
+        deg += 360.0f;
+    }
+    return deg;
+}
+
+//
+// Send per-bin results to Python:
+// f, closed-loop gain and phase (I/Iref), plant gain and phase (I/duty in mA/%)
+// Only completed bins are sent, so a sweep cut short by a fault, a mode
+// change or a rate degrade reports what it measured and nothing more.
+//
+void send_fresp_data() {
+    char message[100];
+    int nbins = DoneBins;
+    if (arena_owner() != FRESP) {
+        nbins = 0;      // Buffers were reclaimed by another mode
+    }
+    sprintf(message, "%d\r\n", nbins);
+    NU32DIP_WriteUART1(message);
+
+    for (int i = 0; i < nbins; i++) {
+        FrespBin *b = &Bins[i];
+        float ref_mag = sqrtf(b->ref_re*b->ref_re + b->ref_im*b->ref_im);
+        float cur_mag = sqrtf(b->cur_re*b->cur_re + b->cur_im*b->cur_im);
+        float duty_mag = sqrtf(b->duty_re*b->duty_re + b->duty_im*b->duty_im);
+        float cur_ph = atan2f(b->cur_im, b->cur_re);
+        float cl_mag = (ref_mag > 0) ? cur_mag / ref_mag : 0;
+        float cl_ph = wrap_deg(cur_ph - atan2f(b->ref_im, b->ref_re));
+        float pl_mag = (duty_mag > 0) ? cur_mag / duty_mag : 0;
+        float pl_ph = wrap_deg(cur_ph - atan2f(b->duty_im, b->duty_re));
+
+        sprintf(message, "%f %f %f %f %f\r\n", b->f, cl_mag, cl_ph, pl_mag, pl_ph);
+        NU32DIP_WriteUART1(message);
+    }
+}
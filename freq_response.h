@@ -0,0 +1,11 @@
+#ifndef FREQ_RESPONSE__H__
+#define FREQ_RESPONSE__H__
+
+#define FRESP_MAXBINS 32          // Max number of frequency bins per sweep
+
+int fresp_setup(float fmin, float fmax, int nbins, float amplitude);
+float fresp_reference();
+int fresp_advance(float current, float duty);
+void send_fresp_data();
+
+#endif // FREQ_RESPONSE__H__
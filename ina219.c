@@ -8,9 +8,13 @@
 
 #define INA219_ADDR 0b1000000 // I2C address
 #define INA219_REG_CONFIG 0x00 // config register address
+#define INA219_REG_BUS 0x02 // bus voltage register
 #define INA219_REG_CURRENT 0x04 // current register
 #define INA219_REG_CALIBRATION 0x05 // calibration register
 
+static volatile int Pointer = -1; // register the INA219 pointer was left at (-1 unknown)
+static signed short LastCurrent = 0; // current register from the last INA219_read_sample()
+
 //  Initialize I2C1 and the INA219 current sensor
 void INA219_Startup() {
   // disable interrupts
@@ -24,6 +28,7 @@ void INA219_Startup() {
   unsigned short ina219_config = 0b0011000010001111;
   writeINA219(INA219_REG_CALIBRATION, ina219_calValue);
   writeINA219(INA219_REG_CONFIG, ina219_config);
+  readINA219(INA219_REG_CURRENT); // leave the pointer at the current register
 
   __builtin_enable_interrupts();
 }
@@ -31,10 +36,67 @@ void INA219_Startup() {
 // get the current in mA
 float INA219_read_current(){
   signed short value = readINA219(INA219_REG_CURRENT);
-  float ma = value / 3.0;
+  float ma = value / INA219_LSB_PER_MA;
   return ma;
 }
 
+// Read for the control loop, one I2C transaction per call and one
+// register per transaction. The INA219 keeps its register pointer between
+// transactions, so while it is parked at the current register a read needs
+// no pointer write (3 bytes instead of 5). With request_bus the pointer is
+// moved to the bus voltage register at the end of the transaction, and the
+// next call reads the bus voltage and parks the pointer back. That call
+// repeats the previous current with current_fresh clear, so no transaction
+// is longer than the plain 5-byte read. The power register is never read:
+// the INA219 derives it from the same current and bus voltage, and a third
+// register would cost another pointer move per tick.
+void INA219_read_sample(INA219_Sample *s, int request_bus){
+  s->bus_fresh = 0;
+  s->current_fresh = 0;
+  if (Pointer == INA219_REG_BUS) {
+    i2c_master_start();
+    i2c_master_send((INA219_ADDR<<1)|0b1); // read the parked bus voltage register
+    unsigned char r1 = i2c_master_recv();
+    i2c_master_ack(0);
+    unsigned char r2 = i2c_master_recv();
+    i2c_master_ack(1);
+    i2c_master_restart();
+    i2c_master_send(INA219_ADDR<<1); // park the pointer at the current register
+    i2c_master_send(INA219_REG_CURRENT);
+    i2c_master_stop();
+    Pointer = INA219_REG_CURRENT;
+
+    s->bus = (((r1<<8)|r2) >> 3) * INA219_BUS_MV_PER_LSB;
+    s->bus_fresh = 1;
+    s->current = LastCurrent;   // not a new measurement
+    return;
+  }
+
+  i2c_master_start();
+  if (Pointer != INA219_REG_CURRENT) {
+    i2c_master_send(INA219_ADDR<<1); // pointer unknown, set it first
+    i2c_master_send(INA219_REG_CURRENT);
+    i2c_master_restart();
+  }
+  i2c_master_send((INA219_ADDR<<1)|0b1); // read from the INA219
+  unsigned char r1 = i2c_master_recv();
+  i2c_master_ack(0);
+  unsigned char r2 = i2c_master_recv();
+  i2c_master_ack(1);
+  Pointer = INA219_REG_CURRENT;
+  if (request_bus) {
+    i2c_master_restart();
+    i2c_master_send(INA219_ADDR<<1); // move the pointer for the next call
+    i2c_master_send(INA219_REG_BUS);
+    Pointer = INA219_REG_BUS;
+  }
+  i2c_master_stop();
+
+  LastCurrent = (r1<<8)|r2;
+  s->current = LastCurrent;
+  s->current_fresh = 1;
+}
+
 // write 2 bytes
 void writeINA219(unsigned char reg, unsigned short value){
   i2c_master_start();
@@ -43,6 +105,7 @@ void writeINA219(unsigned char reg, unsigned short value){
   i2c_master_send(value>>8);
   i2c_master_send(value&0xff);
   i2c_master_stop();
+  Pointer = reg;
 }
 
 // read 2 bytes
@@ -57,6 +120,7 @@ signed short readINA219(unsigned char reg){
   unsigned char r2 = i2c_master_recv();
   i2c_master_ack(1); // no more reads
   i2c_master_stop();
+  Pointer = reg;
 
   signed short value = (r1<<8)|r2;
   return value;
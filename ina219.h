@@ -7,8 +7,19 @@
 #include "NU32DIP.h"
 #include "i2c_master_noint.h"
 
+#define INA219_LSB_PER_MA 3.0f   // Current register LSBs per mA
+#define INA219_BUS_MV_PER_LSB 4  // Bus voltage LSB (mV), after dropping the flag bits
+
+typedef struct {
+  signed short current;   // Current register, INA219_LSB_PER_MA per mA
+  int current_fresh;      // Current was read in this transaction, else repeated
+  unsigned short bus;     // Bus voltage (mV), valid if bus_fresh
+  int bus_fresh;          // Bus voltage was read in this transaction
+} INA219_Sample;
+
 void INA219_Startup();
 float INA219_read_current();
+void INA219_read_sample(INA219_Sample *s, int request_bus);
 
 void writeINA219(unsigned char, unsigned short);
 signed short readINA219(unsigned char);
@@ -13,6 +13,17 @@
 #include "current_control.h"
 #include "ina219.h"
 #include "position_control.h"
+#include "freq_response.h"
+#include "protection.h"
+#include "scheduler.h"
+#include "stream.h"
+#include "motion_queue.h"
+#include "arena.h"
+#include "feedforward.h"
+#include "filter.h"
+#include "power.h"
+#include "capture.h"
+#include "autotune.h"
 
 
 
@@ -27,12 +38,12 @@ int main()
 
     __builtin_disable_interrupts();
 
-    make_waveform();
     set_mode(IDLE); // Set initial mode to IDLE
     UART2_Startup(); // Initialize UART2
     Current_Control_Startup(); // Initialize current controller and PWM
     Position_Control_Startup(); // Initialize position controller
     INA219_Startup();
+    Scheduler_Startup(); // Start the control loops
 
     __builtin_enable_interrupts();
     while(1)
@@ -42,9 +53,19 @@ int main()
 
         // Check for menu command
         switch (buffer[0]) {
+            case 'a':                      // a: Load time-optimal trajectory
+            {
+                read_traj();
+                break;
+            }
             case 'b':                      // b: Read current sensor (mA)
             {
-                float current = INA219_read_current();
+                float current;
+                if (get_mode() == IDLE) {
+                    current = INA219_read_current();    // I2C1 is free
+                } else {
+                    current = get_current();    // The current loop owns I2C1, use its last sample
+                }
                 char m[50];
                 sprintf(m,"%f\r\n",current);
                 NU32DIP_WriteUART1(m);
@@ -52,22 +73,17 @@ int main()
             }
             case 'c':                      // c: Read encoder value (counts)
             {
-                WriteUART2("a");
-                while(!get_encoder_flag()) {
-                    ;
-                }
-                set_encoder_flag(0);
                 char m[50];
-                int p = get_encoder_count();
+                int p = read_position();
                 sprintf(m,"%d\r\n",p);
                 NU32DIP_WriteUART1(m);
                 break;
             }
             case 'd':                      // d: Read encoder value (degrees)
             {
-                int degrees = read_encoder_deg();
+                int cdeg = counts_to_cdeg(read_position());
                 char m[50];
-                sprintf(m,"%d\r\n",degrees);
+                sprintf(m,"%.2f\r\n",cdeg / 100.0f);
                 NU32DIP_WriteUART1(m);
                 break;
             }
@@ -151,22 +167,24 @@ int main()
             }
             case 'k':                       // k: Test current gains
             {
-                set_mode(ITEST);    // Test current and send plot data
+                if (!start_itest()) {   // Test current and send plot data
+                    NU32DIP_GREEN = 0;  // Error
+                }
                 send_curr_data();
                 break;
             }
             case 'l':                       // l: Go to angle (deg)
             {
                 char angBuffer[BUF_SIZE];
-                NU32DIP_ReadUART1(angBuffer,BUF_SIZE); // Read PWM value
-                int ang;
-                int valid = sscanf(angBuffer, "%d", &ang);
+                NU32DIP_ReadUART1(angBuffer,BUF_SIZE); // Read angle value
+                float ang;
+                int valid = sscanf(angBuffer, "%f", &ang);
                 if (valid != 1) {
                     NU32DIP_GREEN = 0;  // Error
                     break;
                 }
-                set_mode(HOLD);  // Set mode to PWM
-                set_angle(ang);
+                set_angle(deg_to_counts(ang));  // Convert to counts before the ISR sees it
+                set_mode(HOLD);  // Set mode to HOLD
                 break;
             }
             case 'm':                       // m: Load step trajectory
@@ -181,7 +199,9 @@ int main()
             }
             case 'o':                       // o: Exectue trajectory
             {
-                set_mode(TRACK);
+                if (!start_track()) {
+                    NU32DIP_GREEN = 0;  // Error, no trajectory loaded
+                }
                 while (get_mode() == TRACK) {
                     ;   // Wait until trajectory is done being followed
                 }
@@ -191,6 +211,7 @@ int main()
             case 'p':                       // p: Unpower the motor
             {
                 set_mode(IDLE);
+                queue_clear();
                 break;
             }
             case 'q':                       // q: Quit
@@ -206,6 +227,321 @@ int main()
                 NU32DIP_WriteUART1(m);
                 break;
             }
+            case 's':                       // s: Get run metrics
+            {
+                send_curr_metrics();
+                send_pos_metrics();
+                break;
+            }
+            case 't':                       // t: Execute trajectory (metrics only)
+            {
+                if (!start_track()) {
+                    NU32DIP_GREEN = 0;  // Error, no trajectory loaded
+                }
+                while (get_mode() == TRACK) {
+                    ;   // Wait until trajectory is done being followed
+                }
+                send_pos_metrics();
+                break;
+            }
+            case 'u':                       // u: Test current gains (metrics only)
+            {
+                if (!start_itest()) {
+                    NU32DIP_GREEN = 0;  // Error
+                }
+                while (get_mode() == ITEST) {
+                    ;   // Wait until the test is done
+                }
+                send_curr_metrics();
+                break;
+            }
+            case 'v':                       // v: Current loop frequency response
+            {
+                float fmin=0, fmax=0, amp=0;
+                int nbins=0;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read start frequency (Hz)
+                int fmin_val = sscanf(inp, "%f", &fmin);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read end frequency (Hz)
+                int fmax_val = sscanf(inp, "%f", &fmax);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read number of bins
+                int nbins_val = sscanf(inp, "%d", &nbins);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read amplitude (mA)
+                int amp_val = sscanf(inp, "%f", &amp);
+                if (fmin_val != 1 || fmax_val != 1 || nbins_val != 1 || amp_val != 1
+                    || !fresp_setup(fmin, fmax, nbins, amp)) {
+                    NU32DIP_GREEN = 0;  // Error
+                    NU32DIP_WriteUART1("0\r\n");
+                    break;
+                }
+                set_mode(FRESP);
+                while (get_mode() == FRESP) {
+                    ;   // Wait until the sweep is done
+                }
+                send_fresp_data();
+                break;
+            }
+            case 'w':                       // w: Get fault status
+            {
+                send_fault_status();
+                break;
+            }
+            case 'x':                       // x: Clear fault
+            {
+                set_mode(IDLE);
+                protection_clear();
+                break;
+            }
+            case 'y':                       // y: Set protection limits
+            {
+                float inst_in=0, rms_in=0, stall_in=0;
+                int stall_ms_in=0;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read instantaneous limit (mA)
+                int inst_val = sscanf(inp, "%f", &inst_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read I^2t RMS limit (mA)
+                int rms_val = sscanf(inp, "%f", &rms_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read stall current (mA)
+                int stall_val = sscanf(inp, "%f", &stall_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read stall time (ms, 0 disables)
+                int stall_ms_val = sscanf(inp, "%d", &stall_ms_in);
+                if (inst_val != 1 || rms_val != 1 || stall_val != 1 || stall_ms_val != 1) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                set_protection_limits(inst_in, rms_in, stall_in, stall_ms_in);
+                break;
+            }
+            case 'z':                       // z: Stream setpoints
+            {
+                char inp[BUF_SIZE];
+                int delay_ms;
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read playout delay (ms)
+                if (sscanf(inp, "%d", &delay_ms) != 1 || delay_ms < 0) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                set_angle(read_position());   // Hold here until setpoints arrive
+                stream_start(delay_ms);
+                set_mode(STREAM);
+
+                // Read "t_ms angle_deg" setpoints until "e". The first
+                // one anchors the stream clock and is echoed straight
+                // back, so the client can time the link.
+                int anchored = 0;
+                while (1) {
+                    NU32DIP_ReadUART1(inp,BUF_SIZE);
+                    if (inp[0] == 'e') {
+                        break;
+                    }
+                    int t_ms;
+                    float ang;
+                    if (sscanf(inp, "%d %f", &t_ms, &ang) != 2) {
+                        NU32DIP_GREEN = 0;  // Error, skip the packet
+                        continue;
+                    }
+                    if (stream_push(t_ms, deg_to_counts(ang)) && !anchored) {
+                        char m[20];
+                        sprintf(m, "%d\r\n", t_ms);
+                        NU32DIP_WriteUART1(m);
+                        anchored = 1;
+                    }
+                }
+                if (get_mode() == STREAM) {
+                    set_mode(HOLD);     // Hold the last setpoint
+                }
+                send_stream_stats();
+                break;
+            }
+            case 'A':                       // A: Queue go to angle
+            {
+                char inp[BUF_SIZE];
+                float ang;
+                int duration_ms;
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read angle (deg)
+                int ang_val = sscanf(inp, "%f", &ang);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read move time (ms)
+                int dur_val = sscanf(inp, "%d", &duration_ms);
+                if (ang_val != 1 || dur_val != 1 || !queue_goto(deg_to_counts(ang), duration_ms)) {
+                    NU32DIP_GREEN = 0;  // Error
+                }
+                break;
+            }
+            case 'B':                       // B: Queue via-point trajectory
+            {
+                char inp[BUF_SIZE];
+                int t_ms[QUEUE_MAX_VIA], counts[QUEUE_MAX_VIA];
+                int n = 0, valid = 1;
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read number of via points
+                if (sscanf(inp, "%d", &n) != 1 || n < 1 || n > QUEUE_MAX_VIA) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                for (int i = 0; i < n; i++) {   // Read "t_ms angle_deg" via points
+                    float ang = 0;
+                    NU32DIP_ReadUART1(inp,BUF_SIZE);
+                    if (sscanf(inp, "%d %f", &t_ms[i], &ang) != 2) {
+                        valid = 0;
+                    }
+                    counts[i] = deg_to_counts(ang);
+                }
+                if (!valid || !queue_via(t_ms, counts, n)) {
+                    NU32DIP_GREEN = 0;  // Error
+                }
+                break;
+            }
+            case 'C':                       // C: Queue dwell
+            {
+                char inp[BUF_SIZE];
+                int duration_ms;
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read dwell time (ms)
+                if (sscanf(inp, "%d", &duration_ms) != 1 || !queue_dwell(duration_ms)) {
+                    NU32DIP_GREEN = 0;  // Error
+                }
+                break;
+            }
+            case 'D':                       // D: Get queue status
+            {
+                send_queue_status();
+                break;
+            }
+            case 'E':                       // E: Execute queue
+            {
+                queue_start();
+                break;
+            }
+            case 'F':                       // F: Set feedforward motor model
+            {
+                float J_in=0, b_in=0, c_in=0, Kt_in=0;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read inertia (kg*m^2)
+                int J_val = sscanf(inp, "%f", &J_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read viscous friction (N*m*s/rad)
+                int b_val = sscanf(inp, "%f", &b_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read Coulomb friction (N*m)
+                int c_val = sscanf(inp, "%f", &c_in);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read torque constant (N*m/A, 0 disables)
+                int Kt_val = sscanf(inp, "%f", &Kt_in);
+                if (J_val != 1 || b_val != 1 || c_val != 1 || Kt_val != 1) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                set_feedforward(J_in, b_in, c_in, Kt_in);
+                break;
+            }
+            case 'G':                       // G: Set measurement filter
+            {
+                int ch, median, nbiquads, alpha;
+                int coeffs[FILTER_MAX_BIQUADS][5];
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read "channel median nbiquads deriv_alpha"
+                int valid = sscanf(inp, "%d %d %d %d", &ch, &median, &nbiquads, &alpha);
+                if (valid != 4 || ch < 0 || ch >= FILT_NUM_CHANNELS || nbiquads < 0
+                    || nbiquads > FILTER_MAX_BIQUADS || alpha <= 0 || alpha > (1 << FILTER_Q)) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                for (int i = 0; i < nbiquads; i++) {
+                    NU32DIP_ReadUART1(inp,BUF_SIZE); // Read "b0 b1 b2 a1 a2" (Q30)
+                    if (sscanf(inp, "%d %d %d %d %d", &coeffs[i][0], &coeffs[i][1],
+                               &coeffs[i][2], &coeffs[i][3], &coeffs[i][4]) != 5) {
+                        valid = 0;
+                    }
+                }
+                if (valid != 4) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                set_filter((FilterChannel) ch, median, nbiquads, coeffs, (short) alpha);
+                break;
+            }
+            case 'H':                       // H: Get filter costs
+            {
+                send_filter_costs();
+                break;
+            }
+            case 'K':                       // K: Autotune current and position gains
+            {
+                int rule, curr_relay;
+                float curr_hyst, pos_relay;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read "rule current_relay(%) hysteresis(mA) position_relay(mA)"
+                int valid = sscanf(inp, "%d %d %f %f", &rule, &curr_relay, &curr_hyst, &pos_relay);
+                if (valid != 4 || rule < 0 || rule >= AT_NUM_RULES || curr_relay <= 0 || curr_relay > 100
+                    || curr_hyst < 0 || pos_relay <= 0) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                if (!autotune_start((TuningRule) rule, curr_relay, curr_hyst, pos_relay)) {
+                    NU32DIP_GREEN = 0;  // Error, fault latched
+                }
+                break;
+            }
+            case 'L':                       // L: Get autotune report
+            {
+                send_autotune_report();
+                break;
+            }
+            case 'M':                       // M: Get RAM usage per mode
+            {
+                send_arena_report();
+                break;
+            }
+            case 'N':                       // N: Read back trajectory (deg) without running it
+            {
+                send_traj_ref();
+                break;
+            }
+            case 'O':                       // O: Get overrun counters
+            {
+                send_overrun_stats();
+                break;
+            }
+            case 'P':                       // P: Set overrun policy
+            {
+                int policy, threshold;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read policy (0 count, 1 degrade, 2 idle)
+                int policy_val = sscanf(inp, "%d", &policy);
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read overruns per window that trigger it
+                int threshold_val = sscanf(inp, "%d", &threshold);
+                if (policy_val != 1 || threshold_val != 1 || policy < OVR_POLICY_NONE
+                    || policy > OVR_POLICY_IDLE || threshold < 1) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                set_overrun_policy((OverrunPolicy) policy, threshold);
+                break;
+            }
+            case 'T':                       // T: Arm triggered capture
+            {
+                int trig, level, post, decimation;
+                char inp[BUF_SIZE];
+                NU32DIP_ReadUART1(inp,BUF_SIZE); // Read "trigger level post decimation"
+                int valid = sscanf(inp, "%d %d %d %d", &trig, &level, &post, &decimation);
+                if (valid != 4 || trig < 0 || trig >= CAP_NUM_TRIGGERS || post < 1
+                    || post > CAPTURE_DEPTH || decimation < 1) {
+                    NU32DIP_GREEN = 0;  // Error
+                    break;
+                }
+                capture_arm((CaptureTrigger) trig, level, post, decimation);
+                break;
+            }
+            case 'U':                       // U: Force capture trigger
+            {
+                capture_force();
+                break;
+            }
+            case 'V':                       // V: Upload capture
+            {
+                send_capture();
+                break;
+            }
+            case 'W':                       // W: Get power and energy summary
+            {
+                send_power_summary();
+                break;
+            }
             default:
             {
                 NU32DIP_GREEN = 0;  // Turn on LED2 to indicate an error
@@ -0,0 +1,150 @@
+// metrics.c
+//
+// This file contains incremental tracking and step-response metrics,
+// updated one sample at a time from inside the control ISRs.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include <stdio.h>
+#include "metrics.h"
+
+#define METRICS_SETTLE_BAND 0.02f   // Settling band as a fraction of step size
+#define METRICS_STILL 0.5f          // Reference change still treated as holding
+#define METRICS_PLATEAU 3           // Samples the reference must hold to form a plateau
+
+//
+// Close the current step and fold it into the worst-case values
+//
+static void close_step(Metrics *m) {
+    if (!m->step_open) {
+        return;
+    }
+    int lo = (m->rise_lo >= 0) ? m->rise_lo : m->step_start;
+    int rise = (m->rise_hi >= 0) ? m->rise_hi - lo : m->n - m->step_start;
+    int settle = (m->last_out >= m->step_start) ? m->last_out + 1 - m->step_start : 0;
+    float overshoot = (m->step_peak - 1.0f) * 100.0f;
+
+    if (overshoot > m->overshoot) {
+        m->overshoot = overshoot;
+    }
+    if (rise > m->rise) {
+        m->rise = rise;
+    }
+    if (settle > m->settle) {
+        m->settle = settle;
+    }
+    m->steps++;
+    m->step_open = 0;
+}
+
+//
+// Clear all accumulators before a run
+//
+void metrics_reset(Metrics *m, float jump, float initial_ref) {
+    m->n = 0;
+    m->sum_abs = 0;
+    m->sum_sq = 0;
+    m->max_abs = 0;
+    m->jump = jump;
+    m->prev_ref = initial_ref;
+    m->plateau = initial_ref;   // The reference held before the run
+    m->held = METRICS_PLATEAU;
+    m->leave = -1;
+    m->step_open = 0;
+    m->steps = 0;
+    m->overshoot = 0;
+    m->rise = 0;
+    m->settle = 0;
+}
+
+//
+// Add one (reference, actual) sample
+//
+void metrics_update(Metrics *m, float ref, float actual) {
+    float error = ref - actual;
+    float abs_error = fabsf(error);
+    m->sum_abs += abs_error;
+    m->sum_sq += error*error;
+    if (abs_error > m->max_abs) {
+        m->max_abs = abs_error;
+    }
+
+    // Track reference plateaus. A step starts where the reference left its
+    // last plateau, once it has moved more than jump away from it.
+    if (fabsf(ref - m->prev_ref) <= METRICS_STILL) {
+        m->held++;
+    } else {
+        m->held = 0;
+    }
+    if (m->leave < 0 && fabsf(ref - m->plateau) > METRICS_STILL) {
+        m->leave = m->n;
+    }
+    if (m->leave >= 0 && fabsf(ref - m->plateau) > m->jump
+            && !(m->step_open && m->step_start == m->leave)) {
+        close_step(m);
+        m->step_open = 1;
+        m->step_start = m->leave;
+        m->step_base = m->plateau;
+        m->step_peak = 0;
+        m->rise_lo = -1;
+        m->rise_hi = -1;
+        m->last_out = m->n - 1;     // Samples before the step was recognised
+    }
+    if (m->held >= METRICS_PLATEAU) {
+        m->plateau = ref;
+        m->leave = -1;
+    }
+
+    if (m->step_open) {
+        // Normalise against the reference at this sample, which is the
+        // step target once the reference settles on its new plateau
+        float size = ref - m->step_base;
+        if (fabsf(size) > m->jump) {
+            float p = (actual - m->step_base) / size;  // Normalised response, 1 at target
+            if (p > m->step_peak) {
+                m->step_peak = p;
+            }
+            if (m->rise_lo < 0 && p >= 0.1f) {
+                m->rise_lo = m->n;
+            }
+            if (m->rise_hi < 0 && p >= 0.9f) {
+                m->rise_hi = m->n;
+            }
+            if (fabsf(p - 1.0f) > METRICS_SETTLE_BAND) {
+                m->last_out = m->n;
+            }
+        } else {
+            m->last_out = m->n;     // Reference back near its base, not settled
+        }
+    }
+
+    m->prev_ref = ref;
+    m->n++;
+}
+
+//
+// Finish a run, closing any open step
+//
+void metrics_finish(Metrics *m) {
+    close_step(m);
+}
+
+//
+// Format a summary line: mae rms max overshoot(%) rise(ms) settle(ms) steps samples
+// Errors are multiplied by scale to convert to client units. The step
+// fields are sent as nan when the reference had no step.
+//
+void metrics_sprint(char *buf, const Metrics *m, float scale, float period_ms) {
+    float mae = 0, rms = 0;
+    if (m->n > 0) {
+        mae = m->sum_abs / m->n;
+        rms = sqrtf(m->sum_sq / m->n);
+    }
+    if (m->steps == 0) {
+        sprintf(buf, "%f %f %f nan nan nan 0 %d\r\n", mae*scale, rms*scale, m->max_abs*scale, m->n);
+        return;
+    }
+    sprintf(buf, "%f %f %f %f %f %f %d %d\r\n", mae*scale, rms*scale, m->max_abs*scale,
+            m->overshoot, m->rise*period_ms, m->settle*period_ms, m->steps, m->n);
+}
@@ -0,0 +1,33 @@
+#ifndef METRICS__H__
+#define METRICS__H__
+
+typedef struct {
+    int n;                  // Samples accumulated
+    float sum_abs;          // Sum of |error|
+    float sum_sq;           // Sum of error^2
+    float max_abs;          // Largest |error|
+    float jump;             // Move between reference plateaus that counts as a step
+    float prev_ref;         // Reference from the previous sample
+    float plateau;          // Last reference held for a few samples
+    int held;               // Samples the reference has held its value
+    int leave;              // Sample index where the reference left its plateau (-1 if on it)
+
+    int step_open;          // Non-zero while a step is being tracked
+    int step_start;         // Sample index where the step began
+    float step_base;        // Reference plateau before the step
+    float step_peak;        // Largest normalised response seen during the step
+    int rise_lo, rise_hi;   // Sample index of the 10% and 90% crossings (-1 if not reached)
+    int last_out;           // Last sample outside the settling band
+
+    int steps;              // Number of completed steps
+    float overshoot;        // Worst overshoot over all steps (percent)
+    int rise;               // Worst 10-90% rise time (samples)
+    int settle;             // Worst 2% settling time (samples)
+} Metrics;
+
+void metrics_reset(Metrics *m, float jump, float initial_ref);
+void metrics_update(Metrics *m, float ref, float actual);
+void metrics_finish(Metrics *m);
+void metrics_sprint(char *buf, const Metrics *m, float scale, float period_ms);
+
+#endif // METRICS__H__
@@ -0,0 +1,226 @@
+// motion_queue.c
+//
+// This file contains the motion queue used by QUEUE mode. Moves are stored
+// as cubic segments that the position loop evaluates each tick, so new
+// segments can be appended while earlier ones execute. Each segment starts
+// at the position and velocity the previous one ends with. Consecutive
+// go-tos in the same direction run through the point between them.
+//
+// Author: Jared Berry
+//
+#include "nu32dip.h"
+#include "motion_queue.h"
+#include "position_control.h"
+#include "utilities.h"
+
+typedef struct {
+    float a0, a1, a2, a3;   // pos = a0 + a1*t + a2*t^2 + a3*t^3 (counts, t in ticks)
+    int ticks;              // Segment duration (position ticks)
+    int is_goto;            // Appended by queue_goto(), end velocity may be blended
+} Segment;
+
+static volatile Segment Segments[QUEUE_DEPTH];
+static volatile int Head = 0;           // Next slot written by the main loop
+static volatile int Tail = 0;           // Segment being executed
+static volatile int SegTick = 0;        // Tick within the executing segment
+static volatile int Completed = 0;      // Segments finished since the last clear
+
+static float TailPos = 0;               // Position at the end of the queue (counts)
+static float TailVel = 0;               // Velocity at the end of the queue (counts/tick)
+
+//
+// Number of segments queued, including the one executing
+//
+static int queue_depth() {
+    return (Head - Tail + QUEUE_DEPTH) % QUEUE_DEPTH;
+}
+
+//
+// Anchor the first segment at the present hold target or encoder position
+//
+static void queue_anchor() {
+    if (queue_depth() > 0 || get_mode() == QUEUE) {
+        return;
+    }
+    Mode m = get_mode();
+    TailPos = (m == HOLD || m == TRACK || m == STREAM) ? get_angle() : read_position();
+    TailVel = 0;
+}
+
+//
+// Convert milliseconds to position ticks
+//
+static int ms_to_ticks(int ms) {
+    return ms * POSITION_LOOP_HZ / 1000;
+}
+
+//
+// Position along a segment t ticks after it starts (counts)
+//
+static float segment_pos(volatile Segment *s, float t) {
+    return s->a0 + t*(s->a1 + t*(s->a2 + t*s->a3));
+}
+
+//
+// Fit a segment from (p0, v0) to (p1, v1) over T ticks
+//
+static void fit_cubic(volatile Segment *s, float p0, float v0, float p1, float v1, int T) {
+    s->a0 = p0;
+    s->a1 = v0;
+    s->a2 = (3.0f*(p1 - p0) - (2.0f*v0 + v1)*T) / ((float) T*T);
+    s->a3 = (2.0f*(p0 - p1) + (v0 + v1)*T) / ((float) T*T*T);
+    s->ticks = T;
+}
+
+//
+// Append a cubic from the queue tail to (p1, v1) over T ticks
+//
+static void push_cubic(float p1, float v1, int T, int is_goto) {
+    volatile Segment *s = &Segments[Head];
+    fit_cubic(s, TailPos, TailVel, p1, v1, T);
+    s->is_goto = is_goto;
+    TailPos = p1;
+    TailVel = v1;
+    Head = (Head + 1) % QUEUE_DEPTH;
+}
+
+//
+// Let the last queued go-to run into a new one ending at p2 after T2 ticks,
+// instead of stopping in between. Only done if the last go-to has not
+// started and both move the same way; the boundary velocity is the central
+// difference, as for via points. Call with interrupts disabled.
+//
+static void blend_goto(float p2, int T2) {
+    int last = (Head - 1 + QUEUE_DEPTH) % QUEUE_DEPTH;
+    if (queue_depth() == 0 || !Segments[last].is_goto) {
+        return;
+    }
+    if (last == Tail && (get_mode() == QUEUE || SegTick > 0)) {
+        return;     // Already executing
+    }
+    volatile Segment *s = &Segments[last];
+    float p0 = s->a0, p1 = TailPos;
+    if ((p1 - p0) * (p2 - p1) <= 0) {
+        return;     // Reversal or no move, stop in between
+    }
+    float v1 = (p2 - p0) / (s->ticks + T2);
+    fit_cubic(s, p0, s->a1, p1, v1, s->ticks);
+    TailVel = v1;
+}
+
+//
+// Append a move to an absolute position. Returns 0 if it does not fit.
+//
+int queue_goto(int counts, int duration_ms) {
+    int T = ms_to_ticks(duration_ms);
+    if (T < 1 || queue_depth() >= QUEUE_DEPTH - 1) {
+        return 0;
+    }
+    queue_anchor();
+    __builtin_disable_interrupts();     // The last go-to may be refitted
+    blend_goto(counts, T);
+    push_cubic(counts, 0, T, 1);
+    __builtin_enable_interrupts();
+    return 1;
+}
+
+//
+// Append a cubic trajectory through n via points, with times relative to
+// the end of the queue. Interior velocities are central differences and
+// the trajectory ends at rest. Returns 0 if it does not fit.
+//
+int queue_via(const int *t_ms, const int *counts, int n) {
+    if (n < 1 || n > QUEUE_MAX_VIA || queue_depth() + n >= QUEUE_DEPTH) {
+        return 0;
+    }
+    int prev_t = 0;
+    for (int i = 0; i < n; i++) {
+        if (ms_to_ticks(t_ms[i]) <= ms_to_ticks(prev_t)) {
+            return 0;   // Times must increase by at least one tick
+        }
+        prev_t = t_ms[i];
+    }
+
+    queue_anchor();
+    float p_start = TailPos;
+    for (int i = 0; i < n; i++) {
+        int t0 = (i > 0) ? ms_to_ticks(t_ms[i-1]) : 0;
+        int t1 = ms_to_ticks(t_ms[i]);
+        float v1 = 0;
+        if (i < n - 1) {
+            float p_prev = (i > 0) ? counts[i-1] : p_start;
+            v1 = (counts[i+1] - p_prev) / (float) (ms_to_ticks(t_ms[i+1]) - t0);
+        }
+        push_cubic(counts[i], v1, t1 - t0, 0);
+    }
+    return 1;
+}
+
+//
+// Append a pause at the end of the queue. Returns 0 if it does not fit.
+//
+int queue_dwell(int duration_ms) {
+    int T = ms_to_ticks(duration_ms);
+    if (T < 1 || queue_depth() >= QUEUE_DEPTH - 1) {
+        return 0;
+    }
+    queue_anchor();
+    push_cubic(TailPos, 0, T, 0);
+    return 1;
+}
+
+//
+// Evaluate the queue for this position tick. Returns 0 when it is empty,
+// in which case the position loop keeps holding the last setpoint.
+//
+int queue_sample(int *counts) {
+    if (Tail == Head) {
+        return 0;
+    }
+    volatile Segment *s = &Segments[Tail];
+    float p = segment_pos(s, SegTick);
+    *counts = (int) (p + ((p < 0) ? -0.5f : 0.5f));
+
+    SegTick++;
+    if (SegTick >= s->ticks) {
+        SegTick = 0;
+        Tail = (Tail + 1) % QUEUE_DEPTH;
+        Completed++;
+    }
+    return 1;
+}
+
+//
+// Enter QUEUE mode, starting from where the next sample of the queue is.
+// Does nothing if QUEUE is already running, so the setpoint never jumps back.
+//
+void queue_start() {
+    if (get_mode() == QUEUE) {
+        return;
+    }
+    queue_anchor();
+    float p = (queue_depth() > 0) ? segment_pos(&Segments[Tail], SegTick) : TailPos;
+    set_angle((int) (p + ((p < 0) ? -0.5f : 0.5f)));
+    set_mode(QUEUE);
+}
+
+//
+// Drop every queued segment
+//
+void queue_clear() {
+    __builtin_disable_interrupts();
+    Head = 0;
+    Tail = 0;
+    SegTick = 0;
+    Completed = 0;
+    __builtin_enable_interrupts();
+}
+
+//
+// Send queue depth and completed segment count to Python
+//
+void send_queue_status() {
+    char message[50];
+    sprintf(message, "%d %d\r\n", queue_depth(), Completed);
+    NU32DIP_WriteUART1(message);
+}
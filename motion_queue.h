@@ -0,0 +1,15 @@
+#ifndef MOTION_QUEUE__H__
+#define MOTION_QUEUE__H__
+
+#define QUEUE_DEPTH 32            // Max number of queued segments
+#define QUEUE_MAX_VIA 16          // Max via points in one appended trajectory
+
+int queue_goto(int counts, int duration_ms);
+int queue_via(const int *t_ms, const int *counts, int n);
+int queue_dwell(int duration_ms);
+int queue_sample(int *counts);
+void queue_start();
+void queue_clear();
+void send_queue_status();
+
+#endif // MOTION_QUEUE__H__
@@ -0,0 +1,170 @@
+# motor_id.py
+#
+# This file contains the motor parameter identification tool. It fits an
+# electromechanical DC motor model to ITEST and trajectory runs saved by
+# the client's RunLog:
+#
+#   V = R*i + L*di/dt + Kt*w              (electrical, Ke = Kt in SI units)
+#   Kt*i = J*dw/dt + b*w + c*sign(w)      (mechanical)
+#
+# R, L and Kt are estimated jointly from both kinds of run, with w taken
+# from the angle column. L comes only from ITEST runs: at 5 kHz their
+# di/dt is resolved, while at the 200 Hz trajectory rate the electrical
+# transient is over within a sample and di/dt is noise, so trajectory
+# rows carry no L term. ITEST runs log no angle, and over their 20 ms the
+# rotor barely moves, so their back EMF is taken as zero; Kt is fixed by
+# the trajectory runs. Without ITEST runs L is not estimated.
+#
+# Each run is reduced to least-squares normal equations in a worker
+# process, and the sums are solved once, so large logs use every core.
+#
+# Author: ME333, Jared Berry
+#
+import argparse
+import json
+from concurrent.futures import ProcessPoolExecutor
+import numpy as np
+from run_log import RunLog
+
+SUPPLY_VOLTAGE = 6.0        # H-bridge supply (V), duty 100% = full supply
+CURRENT_LOOP_HZ = 5000      # ITEST sample rate
+POSITION_LOOP_HZ = 200      # Trajectory sample rate
+
+ELEC_PARAMS = ['R', 'L', 'Kt']
+MECH_PARAMS = ['J/Kt', 'b/Kt', 'c/Kt']
+
+def _normal_equations(X, y):
+    """
+    :return: (X^T X, X^T y, y^T y, rows) for one block of regression rows.
+    """
+    return X.T @ X, X.T @ y, float(y @ y), len(y)
+
+def _run_equations(args):
+    """
+    Worker: builds the electrical and mechanical regression rows of one run
+    and reduces them to normal equations.
+
+    :param args: (log root, run metadata record, supply voltage).
+    :return: (electrical, mechanical) normal equations; mechanical is None
+             for ITEST runs.
+    """
+    root, rec, supply = args
+    log = RunLog(root)
+    run_id = rec['run_id']
+    current = np.asarray(log.column(run_id, 'current'), dtype=float)/1000.0   # A
+    volts = np.asarray(log.column(run_id, 'duty'), dtype=float)/100.0*supply  # V
+
+    if rec['mode'] == 'ITEST':
+        # di/dt is resolved at 5 kHz. Back EMF from the angle if it was logged,
+        # else zero: over 20 ms the rotor barely moves.
+        didt = np.gradient(current)*CURRENT_LOOP_HZ
+        w = np.zeros_like(current)
+        if 'angle' in rec['columns']:
+            w = np.gradient(np.radians(np.asarray(log.column(run_id, 'angle'), dtype=float)))*CURRENT_LOOP_HZ
+        X = np.column_stack([current, didt, w])
+        return _normal_equations(X, volts), None
+
+    # 200 Hz: no L term, di/dt at this rate is noise
+    theta = np.radians(np.asarray(log.column(run_id, 'angle'), dtype=float))
+    w = np.gradient(theta)*POSITION_LOOP_HZ
+    dwdt = np.gradient(w)*POSITION_LOOP_HZ
+    elec = _normal_equations(np.column_stack([current, np.zeros_like(current), w]), volts)
+    mech = _normal_equations(np.column_stack([dwdt, w, np.sign(w)]), current)
+    return elec, mech
+
+def _solve(eqs, names, cols=None):
+    """
+    Sums normal equations over runs and solves them.
+
+    :param cols: Indices of the parameters to fit, all by default. The
+                 others are left out of the model.
+    :return: (parameter dict, RMS residual, R^2, rows)
+    """
+    XtX = sum(e[0] for e in eqs)
+    Xty = sum(e[1] for e in eqs)
+    yty = sum(e[2] for e in eqs)
+    rows = sum(e[3] for e in eqs)
+    if cols is not None:
+        XtX, Xty, names = XtX[np.ix_(cols, cols)], Xty[cols], [names[c] for c in cols]
+    theta = np.linalg.lstsq(XtX, Xty, rcond=None)[0]
+    sse = max(yty - 2*theta @ Xty + theta @ XtX @ theta, 0.0)
+    return dict(zip(names, theta.tolist())), float(np.sqrt(sse/rows)), float(1 - sse/yty) if yty > 0 else 0.0, rows
+
+def identify(log, runs=None, supply=SUPPLY_VOLTAGE, workers=None):
+    """
+    Fits the motor model to logged runs.
+
+    :param log: RunLog holding the runs.
+    :param runs: Metadata records to use; every ITEST and TRACK run that
+                 has current and duty columns by default.
+    :param supply: H-bridge supply voltage (V).
+    :param workers: Worker processes, all cores by default.
+    :return: Dictionary of SI parameters and fit statistics.
+    """
+    if runs is None:
+        runs = log.query(where=lambda r: r['mode'] in ('ITEST', 'TRACK')
+                         and 'current' in r['columns'] and 'duty' in r['columns'])
+    if not runs:
+        raise ValueError('no runs with current and duty data to identify from')
+
+    with ProcessPoolExecutor(max_workers=workers) as pool:
+        results = list(pool.map(_run_equations, [(log.root, rec, supply) for rec in runs],
+                                chunksize=max(1, len(runs)//64)))
+
+    # L only appears in ITEST rows; leave it out if there are none
+    has_itest = any(rec['mode'] == 'ITEST' for rec in runs)
+    elec, elec_rms, elec_r2, elec_rows = _solve([r[0] for r in results], ELEC_PARAMS,
+                                                None if has_itest else [0, 2])
+    params = {'R': elec['R'], 'L': elec.get('L'), 'Kt': elec['Kt']}
+    fit = {'runs': len(runs), 'electrical_rows': elec_rows,
+           'electrical_rms_V': elec_rms, 'electrical_r2': elec_r2}
+
+    mech_eqs = [r[1] for r in results if r[1] is not None]
+    if mech_eqs:
+        mech, mech_rms, mech_r2, mech_rows = _solve(mech_eqs, MECH_PARAMS)
+        params['J'] = mech['J/Kt']*params['Kt']
+        params['b'] = mech['b/Kt']*params['Kt']
+        params['c'] = mech['c/Kt']*params['Kt']
+        fit.update({'mechanical_rows': mech_rows, 'mechanical_rms_A': mech_rms,
+                    'mechanical_r2': mech_r2})
+    params['fit'] = fit
+    return params
+
+def export_params(params, path, supply=SUPPLY_VOLTAGE):
+    """
+    Writes fitted parameters as JSON, in SI units, for the offline tuner
+    and for loading into the firmware.
+
+    :param params: Dictionary returned by identify().
+    :param path: Output file.
+    """
+    out = {
+        'R_ohm': params['R'],
+        'L_H': params['L'],
+        'Kt_Nm_per_A': params['Kt'],
+        'J_kgm2': params.get('J'),
+        'b_Nms_per_rad': params.get('b'),
+        'c_Nm': params.get('c'),
+        'supply_V': supply,
+        'fit': params['fit'],
+    }
+    with open(path, 'w') as f:
+        json.dump(out, f, indent=2)
+
+def main():
+    parser = argparse.ArgumentParser(description='Identify motor parameters from logged runs.')
+    parser.add_argument('root', nargs='?', default='runs', help='RunLog directory')
+    parser.add_argument('-o', '--output', default='motor_params.json', help='Output JSON file')
+    parser.add_argument('--supply', type=float, default=SUPPLY_VOLTAGE, help='Supply voltage (V)')
+    parser.add_argument('--workers', type=int, default=None, help='Worker processes')
+    args = parser.parse_args()
+
+    params = identify(RunLog(args.root), supply=args.supply, workers=args.workers)
+    export_params(params, args.output, args.supply)
+    for name in ('R', 'L', 'Kt', 'J', 'b', 'c'):
+        if params.get(name) is not None:
+            print(f'{name} = {params[name]:.6g}')
+    print(f'Saved to {args.output}')
+
+if __name__ == "__main__":
+    main()
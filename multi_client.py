@@ -0,0 +1,320 @@
+# multi_client.py
+#
+# This file contains an asyncio client that drives many motor controllers
+# at once, each on its own serial port (or a board_sim.py pty). Serial I/O
+# is non-blocking and driven by the event loop, so a slow board only holds
+# up its own commands. Gains and trajectories can be broadcast to every board,
+# and trajectories run in lockstep or independently, with results and
+# scores aggregated per board.
+#
+# Author: ME333, Jared Berry
+#
+import argparse
+import asyncio
+import json
+import os
+from concurrent.futures import ThreadPoolExecutor
+from statistics import mean
+import serial
+from traj_plot import gen_optimal_trajectory, read_metrics
+from run_log import RunLog
+
+BAUD = 230400
+READ_TIMEOUT = 30       # Seconds to wait for a reply line before giving up
+
+class AsyncController:
+    """
+    One motor controller on a serial port. Commands are serialised per
+    board by a lock; different boards run concurrently.
+
+    On POSIX the port's file descriptor is non-blocking and registered
+    with the event loop, which feeds received bytes into a StreamReader
+    and resumes writes when the port can take more. Windows event loops
+    cannot watch serial handles, so there each blocking call runs in a
+    worker thread instead.
+    """
+    def __init__(self, port, baud=BAUD):
+        self.port = port
+        self.baud = baud
+        self.ser = None
+        self.fd = None          # Watched by the event loop, None when using threads
+        self.reader = None
+        self.lock = asyncio.Lock()
+
+    async def open(self):
+        loop = asyncio.get_running_loop()
+        self.ser = serial.Serial(self.port, self.baud, timeout=0 if os.name == 'posix' else READ_TIMEOUT)
+        if os.name != 'posix':
+            return
+        try:
+            loop.add_reader(self.ser.fileno(), self._on_readable)
+        except NotImplementedError:
+            self.ser.timeout = READ_TIMEOUT
+            return
+        self.fd = self.ser.fileno()
+        self.reader = asyncio.StreamReader()
+
+    async def close(self):
+        if self.ser is None:
+            return
+        if self.fd is not None:
+            asyncio.get_running_loop().remove_reader(self.fd)
+            self.fd = None
+        self.ser.close()
+
+    def _on_readable(self):
+        try:
+            data = os.read(self.fd, 4096)
+        except BlockingIOError:
+            return
+        except OSError as e:
+            data = b''
+            self.reader.set_exception(e)
+        if data:
+            self.reader.feed_data(data)
+        else:
+            asyncio.get_running_loop().remove_reader(self.fd)
+            self.reader.feed_eof()
+
+    async def _writable(self):
+        loop = asyncio.get_running_loop()
+        ready = loop.create_future()
+        loop.add_writer(self.fd, ready.set_result, None)
+        try:
+            await ready
+        finally:
+            loop.remove_writer(self.fd)
+
+    async def write(self, *lines):
+        data = ''.join(line + '\n' for line in lines).encode()
+        if self.fd is None:
+            await asyncio.to_thread(self.ser.write, data)
+            return
+        view = memoryview(data)
+        while view:
+            try:
+                view = view[os.write(self.fd, view):]
+            except BlockingIOError:
+                pass
+            if view:
+                await self._writable()  # Output buffer full, wait for it to drain
+
+    async def readline(self):
+        if self.fd is None:
+            line = await asyncio.to_thread(self.ser.read_until, b'\n')
+        else:
+            try:
+                line = await asyncio.wait_for(self.reader.readuntil(b'\n'), READ_TIMEOUT)
+            except (asyncio.TimeoutError, asyncio.IncompleteReadError):
+                line = b''
+        if not line.endswith(b'\n'):
+            raise TimeoutError(f'{self.port}: no reply')
+        return line.decode().strip()
+
+    async def command(self, cmd, args=(), replies=0):
+        """
+        Sends a menu command and its argument lines, and reads a fixed
+        number of reply lines.
+
+        :return: List of reply lines.
+        """
+        async with self.lock:
+            await self.write(cmd, *map(str, args))
+            return [await self.readline() for _ in range(replies)]
+
+    # ---------------- Menu commands ----------------
+
+    async def set_current_gains(self, kp, ki, kd):
+        await self.command('g', (kp, ki, kd))
+
+    async def set_position_gains(self, kp, ki, kd):
+        await self.command('i', (kp, ki, kd))
+
+    async def get_gains(self):
+        curr = await self.command('h', replies=3)
+        pos = await self.command('j', replies=3)
+        return {f'{loop}_{name}': float(v) for loop, vals in (('curr', curr), ('pos', pos))
+                for name, v in zip(('kp', 'ki', 'kd'), vals)}
+
+    async def get_mode(self):
+        return int((await self.command('r', replies=1))[0])
+
+    async def go_to_angle(self, deg):
+        await self.command('l', (deg,))
+
+    async def load_trajectory(self, ref):
+        await self.command('a', [len(ref)] + list(ref))
+
+    async def execute_trajectory(self):
+        """
+        Runs the loaded trajectory and reads back its samples.
+
+        :return: (columns, score), or (None, None) if none was loaded.
+        """
+        async with self.lock:
+            await self.write('o')
+            n = int(await self.readline())
+            rows = [list(map(float, (await self.readline()).split())) for _ in range(n)]
+        if n == 0:
+            return None, None
+        _, angle, ref, current, duty = map(list, zip(*rows))
+        score = mean(abs(r - a) for r, a in zip(ref, angle))
+        return {'angle': angle, 'ref': ref, 'current': current, 'duty': duty}, score
+
+    async def execute_trajectory_metrics(self):
+        """
+        Runs the loaded trajectory and reads only its metrics summary.
+        """
+        async with self.lock:
+            await self.write('t')
+            line = await self.readline()
+        return read_metrics(_Line(line))
+
+    async def unpower(self):
+        await self.command('p')
+
+class _Line:
+    """
+    Adapts a reply line already read to the ser.read_until() interface
+    expected by the traj_plot readers.
+    """
+    def __init__(self, line):
+        self.line = (line + '\n').encode()
+
+    def read_until(self, *args):
+        return self.line
+
+class ControllerGroup:
+    """
+    A set of controllers driven together.
+    """
+    def __init__(self, ports, baud=BAUD):
+        self.boards = [AsyncController(p, baud) for p in ports]
+
+    async def __aenter__(self):
+        await asyncio.gather(*(b.open() for b in self.boards))
+        return self
+
+    async def __aexit__(self, *exc):
+        await asyncio.gather(*(b.close() for b in self.boards))
+
+    async def broadcast(self, method, *args):
+        """
+        Calls the same AsyncController method on every board concurrently.
+
+        :return: Dictionary of port to result.
+        """
+        results = await asyncio.gather(*(getattr(b, method)(*args) for b in self.boards),
+                                       return_exceptions=True)
+        return {b.port: r for b, r in zip(self.boards, results)}
+
+    async def run_trajectory(self, ref, lockstep=True, metrics_only=False):
+        """
+        Loads ref on every board and runs it.
+
+        :param lockstep: Start every board only once all have the
+                         trajectory, so they move together. Otherwise each
+                         board starts as soon as its own upload finishes.
+        :param metrics_only: Read back the metrics summary instead of the
+                             samples.
+        :return: Dictionary of port to {'columns', 'score', 'metrics', 'error'}.
+        """
+        async def execute(board):
+            if metrics_only:
+                metrics = await board.execute_trajectory_metrics()
+                return {'columns': None, 'score': metrics['mae'], 'metrics': metrics}
+            columns, score = await board.execute_trajectory()
+            return {'columns': columns, 'score': score, 'metrics': None}
+
+        async def independent(board):
+            await board.load_trajectory(ref)
+            return await execute(board)
+
+        if lockstep:
+            loaded = await self.broadcast('load_trajectory', ref)
+            ready = [b for b in self.boards if not isinstance(loaded[b.port], Exception)]
+            results = await asyncio.gather(*(execute(b) for b in ready), return_exceptions=True)
+            results = dict(zip((b.port for b in ready), results))
+            results.update({p: e for p, e in loaded.items() if isinstance(e, Exception)})
+        else:
+            results = await asyncio.gather(*(independent(b) for b in self.boards), return_exceptions=True)
+            results = dict(zip((b.port for b in self.boards), results))
+
+        return {port: ({'columns': None, 'score': None, 'metrics': None, 'error': repr(r)}
+                       if isinstance(r, Exception) else {**r, 'error': None})
+                for port, r in results.items()}
+
+def summarise(results):
+    """
+    Prints the per-board scores of run_trajectory() and their spread.
+    """
+    scores = {p: r['score'] for p, r in results.items() if r['score'] is not None}
+    for port, r in results.items():
+        status = f"score {r['score']:.3f}" if r['score'] is not None else f"FAILED {r['error'] or 'no trajectory'}"
+        print(f'\t{port}: {status}')
+    if scores:
+        print(f'\tbest {min(scores.values()):.3f}, worst {max(scores.values()):.3f}, '
+              f'mean {mean(scores.values()):.3f} over {len(scores)} boards')
+
+async def run(args):
+    ports = list(args.ports)
+    sims = []
+    if args.sim:
+        from board_sim import BoardSim
+        sims = [BoardSim(realtime=not args.fast, seed=i) for i in range(args.sim)]
+        ports += [s.start() for s in sims]
+
+    # Without event loop serial I/O each board can have a blocking read in
+    # flight, so size the pool to match
+    asyncio.get_running_loop().set_default_executor(ThreadPoolExecutor(max_workers=max(32, 2*len(ports))))
+    log = RunLog(args.log) if args.log else None
+    try:
+        async with ControllerGroup(ports) as group:
+            if args.curr_gains:
+                await group.broadcast('set_current_gains', *args.curr_gains)
+            if args.pos_gains:
+                await group.broadcast('set_position_gains', *args.pos_gains)
+            ref = gen_optimal_trajectory(args.angles, args.profile)
+            await group.broadcast('go_to_angle', args.angles[0])
+
+            results = await group.run_trajectory(ref, lockstep=not args.independent,
+                                                 metrics_only=args.metrics_only)
+            gains = await group.broadcast('get_gains')
+            print(f'Trajectory of {len(ref)} samples on {len(ports)} boards:')
+            summarise(results)
+
+            if log:
+                for port, r in results.items():
+                    if r['score'] is not None:
+                        g = gains[port] if not isinstance(gains[port], Exception) else None
+                        log.log_run('TRACK', r['columns'], g, r['score'],
+                                    {**(r['metrics'] or {}), 'board': port})
+            if args.json:
+                with open(args.json, 'w') as f:
+                    json.dump({p: {k: v for k, v in r.items() if k != 'columns'}
+                               for p, r in results.items()}, f, indent=2)
+            await group.broadcast('unpower')
+    finally:
+        for s in sims:
+            s.close()
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a trajectory on many controllers at once.')
+    parser.add_argument('ports', nargs='*', help='Serial ports of the boards')
+    parser.add_argument('--sim', type=int, default=0, help='Also run this many simulated boards')
+    parser.add_argument('--fast', action='store_true', help='Simulated boards do not run in real time')
+    parser.add_argument('--angles', type=float, nargs='+', default=[0, 90, 0], help='Via points (deg)')
+    parser.add_argument('--profile', choices=['trap', 'scurve'], default='scurve')
+    parser.add_argument('--curr-gains', type=float, nargs=3, metavar=('KP', 'KI', 'KD'))
+    parser.add_argument('--pos-gains', type=float, nargs=3, metavar=('KP', 'KI', 'KD'))
+    parser.add_argument('--independent', action='store_true', help='Start each board as soon as it is loaded')
+    parser.add_argument('--metrics-only', action='store_true', help='Read back metrics instead of samples')
+    parser.add_argument('--log', default='runs', help="RunLog directory, '' to disable")
+    parser.add_argument('--json', help='Write per-board results to this file')
+    args = parser.parse_args()
+    if not args.ports and not args.sim:
+        parser.error('give at least one port or --sim')
+    asyncio.run(run(args))
+
+if __name__ == "__main__":
+    main()
@@ -10,92 +10,179 @@
 #include "current_control.h"
 #include "utilities.h"
 #include "encoder.h"
+#include "metrics.h"
+#include "protection.h"
+#include "scheduler.h"
+#include "stream.h"
+#include "motion_queue.h"
+#include "arena.h"
+#include "feedforward.h"
+#include "filter.h"
+#include "capture.h"
+#include "autotune.h"
 
-static volatile int Angle = 0;              // Desired motor position
+#define POS_EINT_MAX 371                    // Integrator clamp, 100 deg*ticks in counts
+#define TRACK_STEP_JUMP 19.0f               // Move between reference plateaus (counts, ~5 deg) treated as a step
+#define ENCODER_LEAD 3                      // Ticks between encoder request and position update
 
-static volatile float Kp=0, Ki=0, Kd=0;     // Control gains
-static volatile float Eint = 0;               // Integral of error
+static volatile int Angle = 0;              // Desired motor position (encoder counts)
+static volatile int Position = 0;           // Last measured position (encoder counts)
+static volatile int Prefetched = 0;         // Encoder read started for the next update
 
-static volatile float REFarray[TRAJ_NUMSAMPS]; // Trajectory reference
-static volatile float TRAJarray[TRAJ_NUMSAMPS]; // Actual followed trajectory
+static volatile float Kp=0, Ki=0, Kd=0;     // Control gains (mA/deg)
+static volatile float KpC=0, KiC=0, KdC=0;  // Control gains scaled to counts (mA/count)
+static volatile int Eint = 0;               // Integral of error (counts)
+
+// Borrowed from the arena by read_traj()
+static volatile short *REFarray;              // Trajectory reference (counts)
+static volatile short *TRAJarray;             // Actual followed trajectory (counts)
+static volatile short *CURRarray;             // Measured current (mA)
+static volatile short *DUTYarray;             // Applied duty cycle (OC1RS counts, signed)
 static volatile int TrajLength = 0;             // Actual length of trajectory
+static Metrics TrackMetrics;                    // Tracking metrics of the last trajectory
+
+//
+// True while the scheduler is reading the encoder every position tick
+//
+static int encoder_owned(void) {
+    Mode m = get_mode();
+    return m == HOLD || m == TRACK || m == STREAM || m == QUEUE || m == AUTOTUNE || capture_running();
+}
+
+static short clamp_short(int v) {
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+//
+// Start the encoder read ahead of the position update
+//
+static void encoder_prefetch_tick(void) {
+    if (encoder_owned()) {
+        request_encoder_count();
+        Prefetched = 1;
+    }
+}
+
+//
+// Read the prefetched encoder count
+//
+static int collect_position(void) {
+    Prefetched = 0;
+    Position = collect_encoder_count();
+    return Position;
+}
+
+//
+// PID update toward Angle, shared by every position mode
+//
+static void position_pid(int curr_pos) {
+    int error = Angle - filter_sample(FILT_POSITION, curr_pos);   // Calculate position error
+    Eint += error;  // Update integral error
+    float u = KpC*error + KiC*Eint + KdC*filter_derivative(FILT_POSITION, error); // Calculate control signal
 
-void __ISR(_TIMER_4_VECTOR, IPL5SOFT) PositionController(void) {
+    set_torque(u);
+    protection_check_stall(curr_pos, u);
+
+    if (Eint > POS_EINT_MAX) {    // Prevent integrator wind up
+        Eint = POS_EINT_MAX; 
+    } else if (Eint < -POS_EINT_MAX) {
+        Eint = -POS_EINT_MAX;
+    }
+}
+
+//
+// Position loop update, called by the scheduler every SCHED_POSITION_DIVIDER ticks
+//
+static void position_control_tick(void) {
     LATBINV = 0x1000; // Debug output
-    static int curr_ang = 0;
-    static int error = 0;
-    static float u = 0;
-    static int prev_error = 0;
+    static int curr_pos = 0;
     static int traj_index = 0;
 
     switch (get_mode()) {
         case HOLD:
         {
-            curr_ang = read_encoder_deg();  // Read encoder
-            error = Angle - curr_ang;   // Calculate angle error
-            Eint += error;  // Update integral error
-            u = Kp*error + Ki*Eint + Kd*(error - prev_error); // Calculate control signal
-
-            set_torque(u);
-
-            if (Eint > 100.0f) {    // Prevent integrator wind up
-                Eint = 100.0f; 
-            } else if (Eint < -100.0f) {
-                Eint = -100.0f;
-            }
-
-            prev_error = error;     // Update previous error for derivative term
+            curr_pos = collect_position();  // Read prefetched encoder count
+            feedforward_push(Angle);    // Settles to zero at a fixed setpoint
+            position_pid(curr_pos);
             break;
         }
         case TRACK:
         {
-            curr_ang = read_encoder_deg();  // Read encoder
-            TRAJarray[traj_index] = (float) curr_ang;   // Store actual angle
-            set_angle((int) REFarray[traj_index]); // Set ref angle
-            error = Angle - curr_ang;   // Calculate angle error
-            Eint += error;  // Update integral error
-            u = Kp*error + Ki*Eint + Kd*(error - prev_error); // Calculate control signal
-
-            set_torque(u);
-
-            if (Eint > 100.0f) {    // Prevent integrator wind up
-                Eint = 100.0f; 
-            } else if (Eint < -100.0f) {
-                Eint = -100.0f;
+            if (traj_index == 0) {
+                metrics_reset(&TrackMetrics, TRACK_STEP_JUMP, Angle);  // Setpoint held before the run
             }
+            curr_pos = collect_position();  // Read prefetched encoder count
+            TRAJarray[traj_index] = clamp_short(curr_pos);  // Store actual position
+            CURRarray[traj_index] = (short) get_current();
+            DUTYarray[traj_index] = (short) get_duty();
+            metrics_update(&TrackMetrics, REFarray[traj_index], curr_pos);
+            set_angle(REFarray[traj_index]); // Set ref position
 
-            prev_error = error;     // Update previous error for derivative term
+            // Feedforward for the next reference, reached at the next update
+            int next = traj_index + 1 < TrajLength ? traj_index + 1 : TrajLength - 1;
+            int after = next + 1 < TrajLength ? next + 1 : TrajLength - 1;
+            feedforward_update(REFarray[traj_index], REFarray[next], REFarray[after]);
+            position_pid(curr_pos);
 
             traj_index++;
             if(traj_index == TrajLength) {   // If done with trajectory, hold position
+                metrics_finish(&TrackMetrics);
                 traj_index = 0;
                 set_mode(HOLD);
             }
             break;
         }
+        case STREAM:
+        {
+            int ref;
+            curr_pos = collect_position();  // Read prefetched encoder count
+            if (stream_sample(&ref)) {  // Setpoint from the jitter buffer, if any
+                set_angle(ref);
+            }
+            feedforward_push(Angle);
+            position_pid(curr_pos);
+            break;
+        }
+        case QUEUE:
+        {
+            int ref;
+            curr_pos = collect_position();  // Read prefetched encoder count
+            if (queue_sample(&ref)) {   // Setpoint from the executing segment, if any
+                set_angle(ref);
+            }
+            feedforward_push(Angle);
+            position_pid(curr_pos);
+            break;
+        }
+        case AUTOTUNE:
+        {
+            curr_pos = collect_position();  // Read prefetched encoder count
+            feedforward_reset(curr_pos);    // Relay output only
+            autotune_position_tick(curr_pos);
+            break;
+        }
+        default:
+        {
+            traj_index = 0;     // Restart any interrupted trajectory from the beginning
+            if (Prefetched) {
+                collect_position();     // Keep the angle up to date for the capture
+            }
+            feedforward_reset(Angle);
+            filter_reset(FILT_POSITION);
+            break;
+        }
     }
-    IFS0bits.T4IF = 0;  // Clear interrupt flag
 }
 
 //
-// Setup Timer4 for position control ISR
+// Register the position loop with the scheduler. It runs on tick 0 of
+// every period, just before the current loop update that uses its torque.
 //
 void Position_Control_Startup(void) {
     TRISBbits.TRISB12 = 0; // DEBUG
-    //
-    // Timer4 settings (Position Control ISR)
-    //
-    T4CONbits.TCKPS = 2; // Timer4 prescaler N=4
-    PR4 = 60009; // period = (PR4+1) * N * 20.83 ns = 5 ms, 200 Hz
-    TMR4 = 0; // initialize TMR4 count
-
-    // Initialize Timer4 ISR
-    IPC4bits.T4IP = 5;            // interrupt priority 5
-    IPC4bits.T4IS = 0;            // subpriority 0
-    IFS0bits.T4IF = 0;            // clear the int flag
-    IEC0bits.T4IE = 1;            // enable Timer4
-
-    T4CONbits.ON = 1; // turn on Timer4 (Position Controller)
+    scheduler_add(position_control_tick, SCHED_POSITION_DIVIDER, 0);
+    scheduler_add(encoder_prefetch_tick, SCHED_POSITION_DIVIDER,
+                  SCHED_POSITION_DIVIDER - ENCODER_LEAD);
     return;
 }
 
@@ -104,51 +191,132 @@ void Position_Control_Startup(void) {
 //
 void read_traj() {
     char trajBuffer[BUF_SIZE];
+    int length = 0;
     NU32DIP_ReadUART1(trajBuffer,BUF_SIZE); // Trajectory length
-    int valid = sscanf(trajBuffer, "%d", &TrajLength);
+    int valid = sscanf(trajBuffer, "%d", &length);
     if (valid != 1) {
         NU32DIP_GREEN = 0;  // Error
         return;
     }
 
-    // Store trajectory in array
+    // Borrow the TRACK buffers for exactly this length
+    TrajLength = 0;
+    int fits = 0;
+    if (length > 0 && length <= TRAJ_NUMSAMPS && arena_acquire(TRACK)) {
+        REFarray = arena_alloc(length * sizeof(short));
+        TRAJarray = arena_alloc(length * sizeof(short));
+        CURRarray = arena_alloc(length * sizeof(short));
+        DUTYarray = arena_alloc(length * sizeof(short));
+        fits = (REFarray && TRAJarray && CURRarray && DUTYarray);
+    }
+
+    // Store trajectory in array, converting degrees to counts
     float sample;
-    for(int i=0; i < TrajLength; i++) {
+    for(int i=0; i < length; i++) {
         NU32DIP_ReadUART1(trajBuffer,BUF_SIZE); // Read next sample point
         valid = sscanf(trajBuffer, "%f", &sample);
         if (valid != 1) {
             NU32DIP_GREEN = 0;  // Error
             return;
         }
-        REFarray[i] = sample;
+        int counts = deg_to_counts(sample);
+        if (counts > 32767 || counts < -32768) {
+            fits = 0;   // Beyond the +/-8800 deg a stored sample can hold
+        }
+        if (fits) {
+            REFarray[i] = counts;
+        }
     }
+
+    if (!fits) {
+        NU32DIP_GREEN = 0;  // Error, samples were read and discarded
+        return;
+    }
+    TrajLength = length;
+}
+
+//
+// Start following the uploaded trajectory. Returns 0 if there is none,
+// if its buffers have been reclaimed by another mode, or if a latched
+// fault refuses the mode.
+//
+int start_track() {
+    if (TrajLength == 0 || arena_owner() != TRACK) {
+        return 0;
+    }
+    set_mode(TRACK);
+    return get_mode() == TRACK;
 }
 
 //
 // Send plot data to Python
 //
 void send_pos_data() {
-    char message[50];
+    char message[80];
+    if (arena_owner() != TRACK) {
+        TrajLength = 0;     // Buffers were reclaimed by another mode
+    }
     sprintf(message, "%d\r\n", TrajLength); // Send data length
     NU32DIP_WriteUART1(message);
 
     for (int i=0; i<TrajLength; i++) {  // Send plot data
-        sprintf(message, "%d %f %f\r\n", i, TRAJarray[i], REFarray[i]);
+        sprintf(message, "%d %.2f %.2f %d %.1f\r\n", i, counts_to_cdeg(TRAJarray[i]) / 100.0f,
+                counts_to_cdeg(REFarray[i]) / 100.0f, CURRarray[i], DUTYarray[i] * 100.0f / 2400.0f);
         NU32DIP_WriteUART1(message);
     }
 }
 
+//
+// Send the loaded reference to Python (deg) without running it,
+// as stored after conversion to counts
+//
+void send_traj_ref() {
+    char message[30];
+    int length = (arena_owner() == TRACK) ? TrajLength : 0;
+    sprintf(message, "%d\r\n", length);
+    NU32DIP_WriteUART1(message);
+
+    for (int i = 0; i < length; i++) {
+        sprintf(message, "%.2f\r\n", counts_to_cdeg(REFarray[i]) / 100.0f);
+        NU32DIP_WriteUART1(message);
+    }
+}
+
+//
+// Send trajectory metrics summary to Python (errors in degrees)
+//
+void send_pos_metrics() {
+    char message[100];
+    metrics_sprint(message, &TrackMetrics, 1.0f / ENC_COUNTS_PER_DEG, 1000.0f / POSITION_LOOP_HZ);
+    NU32DIP_WriteUART1(message);
+}
+
 //
 // Setters and getters
 //
-void set_angle(int ang) { Angle = ang; }
+void set_angle(int counts) { Angle = counts; }
+int get_angle() { return Angle; }
+int get_position() { return Position; }
+
+//
+// Encoder position for the main loop (counts). While the scheduler owns
+// the encoder its last reading is used, so the two never wait on each
+// other's reply from the Pico.
+//
+int read_position() {
+    if (encoder_owned()) {
+        return Position;
+    }
+    return read_encoder_counts();
+}
 
 //
-// Setters for position control gains
+// Setters for position control gains. Gains are given in mA/deg
+// and pre-scaled to mA/count so the ISR never converts units.
 //
-void set_pos_kp(float kp) { Kp = kp; }
-void set_pos_ki(float ki) { Ki = ki; }
-void set_pos_kd(float kd) { Kd = kd; }
+void set_pos_kp(float kp) { Kp = kp; KpC = kp / ENC_COUNTS_PER_DEG; }
+void set_pos_ki(float ki) { Ki = ki; KiC = ki / ENC_COUNTS_PER_DEG; }
+void set_pos_kd(float kd) { Kd = kd; KdC = kd / ENC_COUNTS_PER_DEG; }
 
 //
 // Getters for position control gains
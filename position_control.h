@@ -1,7 +1,10 @@
 #ifndef POSITION_CONTROL__H__
 #define POSITION_CONTROL__H__
 
-void set_angle(int ang);
+void set_angle(int counts);
+int get_angle();
+int get_position();
+int read_position();
 void set_pos_kp(float kp);
 void set_pos_ki(float ki);
 void set_pos_kd(float kd);
@@ -11,6 +14,9 @@ float get_pos_kd();
 
 void Position_Control_Startup(void);
 void read_traj();
+int start_track();
 void send_pos_data();
+void send_traj_ref();
+void send_pos_metrics();
 
 #endif // POSITION_CONTROL__H__
\ No newline at end of file
@@ -0,0 +1,94 @@
+// power.c
+//
+// This file contains the power and energy telemetry. The current loop
+// reads the bus voltage every POWER_BUS_DECIMATION ticks as part of its
+// INA219 read, and feeds every current sample in here. Power is taken as
+// bus voltage times |current|, and is integrated into energy per run. A
+// run lasts from entering a non-IDLE mode until the next mode change.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include "nu32dip.h"
+#include "power.h"
+#include "scheduler.h"
+
+// Duration and energy are 64-bit integers: float sums stop growing once
+// a run is long enough that one tick falls below their resolution
+typedef struct {
+    Mode mode;          // Mode of the run
+    int ticks;          // Current loop ticks in the run
+    long long us;       // Duration (us)
+    long long energy;   // Energy (nJ)
+    float peak;         // Peak power (mW)
+} PowerRun;
+
+static volatile int BusMv = 0;          // Last bus voltage (mV)
+static volatile int BusTicks = 0;       // Ticks since the last bus voltage read
+static volatile PowerRun Live = { IDLE, 0, 0, 0, 0 };   // Run in progress
+static volatile PowerRun Last = { IDLE, 0, 0, 0, 0 };   // Last completed run
+
+//
+// Returns 1 on the ticks whose INA219 read should include the bus voltage
+//
+int power_bus_due(void) {
+    if (++BusTicks >= POWER_BUS_DECIMATION) {
+        BusTicks = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void power_set_bus(int mv) { BusMv = mv; }
+
+//
+// Account one current loop tick (current in mA, 0 when not measured)
+//
+void power_update(Mode m, float current) {
+    if (m != Live.mode) {
+        if (Live.mode != IDLE) {
+            Last = Live;
+        }
+        Live.mode = m;
+        Live.ticks = 0;
+        Live.us = 0;
+        Live.energy = 0;
+        Live.peak = 0;
+    }
+    if (m == IDLE) {
+        return;
+    }
+
+    float p = BusMv * fabsf(current) / 1000.0f;    // mW
+    int rate = scheduler_rate();
+    Live.ticks++;
+    Live.us += 1000000 / rate;      // Exact for every scheduler rate
+    Live.energy += (long long) (p * 1000000.0f / rate + 0.5f);     // mW * s -> nJ
+    if (p > Live.peak) {
+        Live.peak = p;
+    }
+}
+
+//
+// Send bus voltage (V), then mode, duration (s), energy (mJ), peak and
+// average power (mW) of the run in progress and of the last completed run
+//
+void send_power_summary() {
+    char message[100];
+    PowerRun runs[2];
+    __builtin_disable_interrupts();     // Consistent snapshot
+    runs[0] = Live;
+    runs[1] = Last;
+    __builtin_enable_interrupts();
+
+    sprintf(message, "%f\r\n", BusMv / 1000.0f);
+    NU32DIP_WriteUART1(message);
+    for (int i = 0; i < 2; i++) {
+        float seconds = runs[i].us / 1000 / 1000.0f;
+        float energy = runs[i].energy / 1000 / 1000.0f;     // mJ
+        float avg = runs[i].us > 0 ? (float) runs[i].energy / runs[i].us : 0;    // nJ/us = mW
+        sprintf(message, "%d %f %f %f %f\r\n", (int) runs[i].mode, seconds,
+                energy, runs[i].peak, avg);
+        NU32DIP_WriteUART1(message);
+    }
+}
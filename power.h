@@ -0,0 +1,13 @@
+#ifndef POWER__H__
+#define POWER__H__
+
+#include "utilities.h"
+
+#define POWER_BUS_DECIMATION 25     // Current loop ticks per bus voltage read
+
+int power_bus_due(void);
+void power_set_bus(int mv);
+void power_update(Mode m, float current);
+void send_power_summary();
+
+#endif // POWER__H__
@@ -0,0 +1,127 @@
+// protection.c
+//
+// This file contains overcurrent, I^2t and stall protection. Faults are
+// detected in the control ISRs and latched until cleared by the client.
+// The current loop zeroes the PWM output on the tick a fault is seen.
+//
+// Author: Jared Berry
+//
+#include <math.h>
+#include <stdlib.h>
+#include "nu32dip.h"
+#include "protection.h"
+#include "utilities.h"
+#include "scheduler.h"
+
+#define I2T_TAU 1.0f                         // I^2t filter time constant (s)
+#define STALL_COUNTS 2                       // Movement (counts) that resets the stall timer
+#define CORE_TICKS_PER_US 24                 // Core timer runs at SYSCLK/2
+
+static volatile float InstLimit = 1200.0f;   // Instantaneous current limit (mA)
+static volatile float RmsLimit = 600.0f;     // I^2t (filtered RMS) current limit (mA)
+static volatile float StallCurrent = 500.0f; // Commanded current considered a stall (mA)
+static volatile int StallTicks = POSITION_LOOP_HZ; // Position ticks before a stall trips (0 = off)
+
+static volatile Fault FaultCode = FAULT_NONE;   // Latched fault
+static volatile int ShutdownPending = 0;        // Fault detected, PWM not yet zeroed
+static volatile unsigned int TripTime = 0;      // Core timer at detection
+static volatile unsigned int LatencyLast = 0;   // Detection to shutdown (core ticks)
+static volatile unsigned int LatencyMax = 0;
+static volatile int Trips = 0;                  // Number of faults since startup
+
+static float I2 = 0;          // Low-pass filtered current squared (mA^2)
+
+//
+// Check a current sample against the instantaneous and I^2t limits.
+// Called every current tick, with 0 mA while IDLE so I^2t keeps decaying.
+//
+void protection_check_current(float current) {
+    float i2 = current * current;
+    I2 += (i2 - I2) / (I2T_TAU * scheduler_rate());    // Tracks a degraded loop rate
+
+    if (fabsf(current) > InstLimit) {
+        protection_trip(FAULT_OVERCURRENT);
+    } else if (I2 > RmsLimit * RmsLimit) {
+        protection_trip(FAULT_I2T);
+    }
+}
+
+//
+// Check for a stall: large commanded current while the encoder does not move
+//
+void protection_check_stall(int pos, float torque) {
+    static int ref_pos = 0;
+    static int ticks = 0;
+
+    if (StallTicks <= 0 || fabsf(torque) < StallCurrent || abs(pos - ref_pos) > STALL_COUNTS) {
+        ref_pos = pos;
+        ticks = 0;
+        return;
+    }
+    ticks++;
+    if (ticks >= StallTicks) {
+        ticks = 0;
+        protection_trip(FAULT_STALL);
+    }
+}
+
+//
+// Latch a fault and stop the controllers. The first fault wins.
+//
+void protection_trip(Fault f) {
+    if (FaultCode != FAULT_NONE) {
+        return;
+    }
+    TripTime = _CP0_GET_COUNT();
+    FaultCode = f;
+    ShutdownPending = 1;
+    Trips++;
+    set_mode(IDLE);
+}
+
+//
+// Called by the current loop right after it forces OC1RS to zero
+//
+void protection_shutdown_done() {
+    if (!ShutdownPending) {
+        return;
+    }
+    LatencyLast = _CP0_GET_COUNT() - TripTime;
+    if (LatencyLast > LatencyMax) {
+        LatencyMax = LatencyLast;
+    }
+    ShutdownPending = 0;
+}
+
+int protection_tripped() { return FaultCode != FAULT_NONE; }
+
+//
+// Clear a latched fault so the motor can be powered again. I^2t is left
+// to decay, so clearing it before the motor has cooled trips it again.
+//
+void protection_clear() {
+    __builtin_disable_interrupts();
+    FaultCode = FAULT_NONE;
+    ShutdownPending = 0;
+    __builtin_enable_interrupts();
+}
+
+//
+// Setter for protection limits (mA, mA, mA, ms)
+//
+void set_protection_limits(float inst, float rms, float stall, int stall_ms) {
+    InstLimit = inst;
+    RmsLimit = rms;
+    StallCurrent = stall;
+    StallTicks = stall_ms * POSITION_LOOP_HZ / 1000;
+}
+
+//
+// Send fault code, shutdown latency (us) and trip count to Python
+//
+void send_fault_status() {
+    char message[100];
+    sprintf(message, "%d %f %f %d\r\n", (int) FaultCode, (float) LatencyLast / CORE_TICKS_PER_US,
+            (float) LatencyMax / CORE_TICKS_PER_US, Trips);
+    NU32DIP_WriteUART1(message);
+}
@@ -0,0 +1,21 @@
+#ifndef PROTECTION__H__
+#define PROTECTION__H__
+
+typedef enum {
+    FAULT_NONE,
+    FAULT_OVERCURRENT,
+    FAULT_I2T,
+    FAULT_STALL
+} Fault;
+
+void protection_check_current(float current);
+void protection_check_stall(int pos, float torque);
+void protection_trip(Fault f);
+void protection_shutdown_done();
+int protection_tripped();
+void protection_clear();
+
+void set_protection_limits(float inst, float rms, float stall, int stall_ms);
+void send_fault_status();
+
+#endif // PROTECTION__H__
@@ -0,0 +1,131 @@
+# run_log.py
+#
+# This file contains an on-disk columnar store for run data. Each run's
+# columns are saved as separate .npy files that can be memory-mapped, and
+# a line per run is appended to an index holding its metadata, so queries
+# over thousands of runs only read the index.
+#
+# Author: ME333, Jared Berry
+#
+import json
+import os
+import time
+import numpy as np
+
+INDEX_NAME = 'index.jsonl'
+
+class RunLog:
+    """
+    Columnar store of logged runs.
+
+    Layout:
+        root/index.jsonl                one JSON line of metadata per run
+        root/runs/<run_id>/<col>.npy    one array per column
+    """
+    def __init__(self, root='runs'):
+        self.root = root
+        os.makedirs(os.path.join(root, 'runs'), exist_ok=True)
+        self._index = None  # Cached index, loaded on first query
+
+    def log_run(self, mode, columns=None, gains=None, score=None, metrics=None):
+        """
+        Appends a run to the store.
+
+        :param mode: Controller mode of the run, e.g. 'TRACK' or 'ITEST'.
+        :param columns: Dictionary of column name to 1-D sequence.
+        :param gains: Dictionary of gains in effect, e.g. {'pos_kp': 100}.
+        :param score: Scalar score of the run, if any.
+        :param metrics: Dictionary of extra scalar results.
+        :return: Run id.
+        """
+        columns = columns or {}
+        stamp = time.time()
+        run_id = time.strftime('%Y%m%d-%H%M%S', time.localtime(stamp)) + f'-{int(stamp*1e6) % 1000000:06d}'
+        run_dir = os.path.join(self.root, 'runs', run_id)
+        os.makedirs(run_dir)
+        lengths = {}
+        for name, data in columns.items():
+            arr = np.asarray(data)
+            np.save(os.path.join(run_dir, name + '.npy'), arr)
+            lengths[name] = len(arr)
+
+        record = {'run_id': run_id, 'timestamp': stamp, 'mode': mode,
+                  'gains': gains or {}, 'score': score, 'metrics': metrics or {},
+                  'columns': lengths}
+        with open(os.path.join(self.root, INDEX_NAME), 'a') as f:
+            f.write(json.dumps(record) + '\n')
+        if self._index is not None:
+            self._index.append(record)
+        return run_id
+
+    def index(self):
+        """
+        :return: List of metadata records for every run, oldest first.
+        """
+        if self._index is None:
+            self._index = []
+            path = os.path.join(self.root, INDEX_NAME)
+            if os.path.exists(path):
+                with open(path) as f:
+                    self._index = [json.loads(line) for line in f if line.strip()]
+        return self._index
+
+    def query(self, mode=None, since=None, until=None, where=None):
+        """
+        Selects runs by metadata without touching their column data.
+
+        :param mode: Only runs of this mode.
+        :param since: Only runs at or after this UNIX time.
+        :param until: Only runs before this UNIX time.
+        :param where: Optional predicate on the metadata record.
+        :return: List of matching metadata records.
+        """
+        runs = []
+        for rec in self.index():
+            if mode is not None and rec['mode'] != mode:
+                continue
+            if since is not None and rec['timestamp'] < since:
+                continue
+            if until is not None and rec['timestamp'] >= until:
+                continue
+            if where is not None and not where(rec):
+                continue
+            runs.append(rec)
+        return runs
+
+    def table(self, fields, runs=None):
+        """
+        Gathers scalar metadata into arrays for vectorised analysis,
+        e.g. table(['timestamp', 'score', 'gains.pos_kp']).
+
+        :param fields: Field names; nested keys are joined with '.'.
+        :param runs: Records to use, all runs by default.
+        :return: Dictionary of field name to float array (NaN where missing).
+        """
+        runs = self.index() if runs is None else runs
+        out = {}
+        for field in fields:
+            keys = field.split('.')
+            vals = []
+            for rec in runs:
+                val = rec
+                for key in keys:
+                    val = val.get(key) if isinstance(val, dict) else None
+                vals.append(np.nan if val is None else float(val))
+            out[field] = np.array(vals)
+        return out
+
+    def column(self, run_id, name):
+        """
+        :return: Memory-mapped column array of one run.
+        """
+        return np.load(os.path.join(self.root, 'runs', run_id, name + '.npy'), mmap_mode='r')
+
+    def columns(self, runs, name):
+        """
+        Yields (record, memory-mapped column) for each run that has the column,
+        so large selections can be streamed without loading them all.
+        """
+        for rec in runs:
+            if name in rec['columns']:
+                yield rec, self.column(rec['run_id'], name)
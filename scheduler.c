@@ -0,0 +1,254 @@
+// scheduler.c
+//
+// This file contains the control loop scheduler. A single 5 kHz Timer3 ISR
+// runs the current loop every tick, and the position loop and any other
+// low-rate tasks every Nth tick, always right before the current loop
+// update that uses their result.
+//
+// The ISR also checks its own timing with the core timer. A tick whose work
+// runs past the period is an overrun, and a gap of more than one period
+// since the last tick means ticks were coalesced. Sustained overruns can
+// drop the current loop to a lower rate or fall back to IDLE.
+//
+// Author: Jared Berry
+//
+#include "nu32dip.h"
+#include "scheduler.h"
+#include "utilities.h"
+#include "current_control.h"
+
+#define CORE_TICKS_PER_US 24            // Core timer runs at SYSCLK/2
+#define SCHED_OVR_WINDOW 1000           // Ticks over which overruns are counted for the policy
+
+typedef struct {
+    Task fn;          // Task to run
+    int base;         // Divider at the full current loop rate
+    int lead;         // Ticks before the start of the next period it runs on
+    int divider;      // Run every divider ticks
+    int phase;        // Tick within the period it runs on
+    int count;        // Ticks until the next run
+} SchedTask;
+
+typedef struct {
+    int hz;           // Current loop rate
+    int pr;           // Timer3 period register
+    unsigned int period;  // Tick period (core ticks)
+} SchedRate;
+
+// Every rate keeps the position loop at exactly POSITION_LOOP_HZ
+static const SchedRate Rates[SCHED_NUM_RATES] = {
+    {5000, 9599, 4800},
+    {4000, 11999, 6000},
+    {2000, 23999, 12000},
+    {1000, 47999, 24000},
+};
+
+static SchedTask Tasks[SCHED_MAX_TASKS];
+static volatile int NumTasks = 0;
+static volatile unsigned int Tick = 0;              // Next tick, counted modulo Hyper
+static volatile unsigned int Hyper = 1;             // Least common multiple of the dividers
+
+static volatile int RateLevel = 0;                  // Index into Rates
+static volatile OverrunPolicy Policy = OVR_POLICY_NONE;
+static volatile int Threshold = 10;                 // Overruns per window that trigger the policy
+static volatile int Overruns[NUM_MODES];            // Ticks whose work ran past the period
+static volatile int Missed[NUM_MODES];              // Ticks lost to coalescing
+static volatile unsigned int MaxBusy = 0;           // Longest tick (core ticks)
+static volatile int Degrades = 0;                   // Times the policy acted
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b != 0) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+//
+// Set every task's divider and phase for a current loop rate, and its
+// count from the shared tick so tasks stay exactly lead ticks apart
+//
+static void set_task_timing(int hz) {
+    Hyper = 1;
+    for (int i = 0; i < NumTasks; i++) {
+        int divider = Tasks[i].base * hz / CURRENT_LOOP_HZ;
+        if (divider < 1) {
+            divider = 1;    // Runs every tick at low rates
+        }
+        int phase = divider - Tasks[i].lead;
+        Tasks[i].divider = divider;
+        Tasks[i].phase = (phase > 0) ? phase : 0;
+        Hyper = Hyper / gcd(Hyper, divider) * divider;
+    }
+    Tick %= Hyper;
+    for (int i = 0; i < NumTasks; i++) {
+        int d = Tasks[i].divider;
+        Tasks[i].count = ((Tasks[i].phase - (int) (Tick % d)) % d + d) % d;
+    }
+}
+
+//
+// Change the current loop rate. Every low-rate task keeps its period, and
+// its count is recomputed from its phase rather than scaled, so a task
+// registered a few ticks ahead of another stays exactly that far ahead.
+//
+static void apply_rate(int level) {
+    int old_hz = Rates[RateLevel].hz;
+    int new_hz = Rates[level].hz;
+    Tick = (unsigned int) ((unsigned long long) Tick * new_hz / old_hz);
+    set_task_timing(new_hz);
+    if (Rates[level].pr < PR3) {
+        TMR3 = 0;   // Else a count already past the new period runs on to 0xFFFF
+    }
+    PR3 = Rates[level].pr;
+    RateLevel = level;
+}
+
+//
+// Act on sustained overruns according to the policy
+//
+static void overrun_policy(void) {
+    if (Policy == OVR_POLICY_DEGRADE && RateLevel < SCHED_NUM_RATES - 1) {
+        if (get_mode() == FRESP) {
+            set_mode(IDLE);     // Its bins were planned for the old rate
+        }
+        apply_rate(RateLevel + 1);
+        Degrades++;
+    } else if (Policy != OVR_POLICY_NONE && get_mode() != IDLE) {
+        set_mode(IDLE);     // Nothing left to shed, stop driving the motor
+        Degrades++;
+    }
+}
+
+void __ISR(_TIMER_3_VECTOR, IPL6SOFT) Scheduler(void) {
+    static unsigned int last = 0;
+    static int started = 0;
+    static int window_ticks = 0;
+    static int window_overruns = 0;
+
+    IFS0bits.T3IF = 0;  // Clear interrupt flag first so a late tick is not lost
+
+    unsigned int now = _CP0_GET_COUNT();
+    unsigned int period = Rates[RateLevel].period;
+    Mode mode = get_mode();
+
+    // More than one period since the last tick: ticks were coalesced
+    unsigned int elapsed = now - last;
+    last = now;
+    if (started && elapsed > period + period / 2) {
+        Missed[mode] += (elapsed + period / 2) / period - 1;
+        window_overruns++;
+    }
+    started = 1;
+
+    // Low-rate tasks first, in registration order
+    for (int i = 0; i < NumTasks; i++) {
+        if (Tasks[i].count == 0) {
+            Tasks[i].count = Tasks[i].divider;
+            Tasks[i].fn();
+        }
+        Tasks[i].count--;
+    }
+    Tick = (Tick + 1) % Hyper;
+
+    current_control_tick();   // Current loop runs every tick, last
+
+    // Work ran past the deadline of the next tick
+    unsigned int busy = _CP0_GET_COUNT() - now;
+    if (busy > MaxBusy) {
+        MaxBusy = busy;
+    }
+    if (busy > period) {
+        Overruns[mode]++;
+        window_overruns++;
+    }
+
+    window_ticks++;
+    if (window_ticks >= SCHED_OVR_WINDOW) {
+        if (window_overruns >= Threshold) {
+            overrun_policy();
+        }
+        window_ticks = 0;
+        window_overruns = 0;
+    }
+}
+
+//
+// Register a task to run every divider ticks, starting on tick phase.
+// At lower rates it keeps the same number of ticks before the start of
+// the next period. Returns 0 if the table is full or the arguments are
+// invalid.
+//
+int scheduler_add(Task fn, int divider, int phase) {
+    if (NumTasks >= SCHED_MAX_TASKS || divider < 1 || phase < 0 || phase >= divider) {
+        return 0;
+    }
+    __builtin_disable_interrupts();
+    Tasks[NumTasks].fn = fn;
+    Tasks[NumTasks].base = divider;
+    Tasks[NumTasks].lead = divider - phase;
+    NumTasks++;
+    set_task_timing(Rates[RateLevel].hz);
+    __builtin_enable_interrupts();
+    return 1;
+}
+
+//
+// Current loop rate (Hz), lower than CURRENT_LOOP_HZ if degraded
+//
+int scheduler_rate() { return Rates[RateLevel].hz; }
+
+//
+// Set the overrun policy. Also clears the counters and restores full rate.
+//
+void set_overrun_policy(OverrunPolicy policy, int threshold) {
+    __builtin_disable_interrupts();
+    Policy = policy;
+    Threshold = threshold;
+    for (int i = 0; i < NUM_MODES; i++) {
+        Overruns[i] = 0;
+        Missed[i] = 0;
+    }
+    MaxBusy = 0;
+    Degrades = 0;
+    apply_rate(0);
+    __builtin_enable_interrupts();
+}
+
+//
+// Send rate, policy, longest tick (us) and degrade count, then
+// overruns and missed ticks for each mode, one line per mode
+//
+void send_overrun_stats() {
+    char message[50];
+    sprintf(message, "%d %d %d %f %d\r\n", Rates[RateLevel].hz, (int) Policy, Threshold,
+            (float) MaxBusy / CORE_TICKS_PER_US, Degrades);
+    NU32DIP_WriteUART1(message);
+    for (int i = 0; i < NUM_MODES; i++) {
+        sprintf(message, "%d %d\r\n", Overruns[i], Missed[i]);
+        NU32DIP_WriteUART1(message);
+    }
+}
+
+//
+// Setup Timer3 for the 5kHz scheduler ISR and start it
+//
+void Scheduler_Startup(void) {
+    __builtin_disable_interrupts();
+    //
+    // Timer3 settings (Scheduler ISR)
+    //
+    T3CONbits.TCKPS = 0; // Timer3 prescaler N=1
+    PR3 = 9599; // period = (PR3+1) * N * 20.83 ns = 0.2 ms, 5 kHz
+    TMR3 = 0; // initialize TMR3 count
+
+    // Initialize Timer3 ISR
+    IPC3bits.T3IP = 6;            // interrupt priority 6
+    IPC3bits.T3IS = 0;            // subpriority 0
+    IFS0bits.T3IF = 0;            // clear the int flag
+    IEC0bits.T3IE = 1;            // enable Timer3
+
+    T3CONbits.ON = 1; // turn on Timer3 (Scheduler)
+    __builtin_enable_interrupts();
+}
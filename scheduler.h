@@ -0,0 +1,24 @@
+#ifndef SCHEDULER__H__
+#define SCHEDULER__H__
+
+#include "utilities.h"
+
+#define SCHED_MAX_TASKS 8                                       // Max number of low-rate tasks
+#define SCHED_POSITION_DIVIDER (CURRENT_LOOP_HZ / POSITION_LOOP_HZ) // Current ticks per position tick
+#define SCHED_NUM_RATES 4                                       // Current loop rates to degrade through
+
+typedef void (*Task)(void);
+
+typedef enum {
+    OVR_POLICY_NONE,      // Count overruns only
+    OVR_POLICY_DEGRADE,   // Step down the current loop rate, then IDLE
+    OVR_POLICY_IDLE       // Fall back to IDLE
+} OverrunPolicy;
+
+int scheduler_add(Task fn, int divider, int phase);
+int scheduler_rate();
+void set_overrun_policy(OverrunPolicy policy, int threshold);
+void send_overrun_stats();
+void Scheduler_Startup(void);
+
+#endif // SCHEDULER__H__
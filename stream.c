@@ -0,0 +1,164 @@
+// stream.c
+//
+// This file contains the jitter buffer for STREAM mode. The client sends
+// timestamped setpoints, which are played out by the position loop a fixed
+// delay after the first one arrived. Setpoints are interpolated between
+// packets and extrapolated across late ones.
+//
+// Since the stream clock is anchored on the arrival of the first setpoint,
+// every setpoint is played out the delay plus the first setpoint's link time
+// after the client sent it, to within one position tick. The main loop
+// echoes the first setpoint so the client can measure the link and report
+// the end-to-end latency.
+//
+// Author: Jared Berry
+//
+#include "nu32dip.h"
+#include "stream.h"
+#include "utilities.h"
+
+#define STREAM_TICK_MS (1000 / POSITION_LOOP_HZ)  // Stream clock advance per position tick
+#define STREAM_MAX_EXTRAP 50                       // Max extrapolation past the last setpoint (ms)
+
+typedef struct {
+    int t;          // Client timestamp (ms)
+    int pos;        // Setpoint (counts)
+} Setpoint;
+
+static volatile Setpoint Buffer[STREAM_DEPTH];
+static volatile int Head = 0;           // Next slot written by the main loop
+static volatile int Tail = 0;           // Oldest slot not yet played out
+static volatile int Started = 0;        // Stream clock running
+static volatile int Now = 0;            // Stream clock, in client time (ms)
+static volatile int Delay = 0;          // Playout delay (ms)
+
+static Setpoint Prev, PrevPrev;         // Last two setpoints played out
+static int NumPrev = 0;
+static int InUnderrun = 0;
+
+static int LastT = 0;                   // Timestamp of the last accepted setpoint
+static int Packets = 0, Late = 0, Overflows = 0;
+static volatile int Underruns = 0, UnderrunTicks = 0;
+static float SlackSum = 0;              // Sum of playout slack, arrival to playout time (ms)
+static int SlackMin = 0;                // Smallest slack, negative if a setpoint was late
+
+//
+// Reset the buffer and statistics before a stream
+//
+void stream_start(int delay_ms) {
+    __builtin_disable_interrupts();
+    Head = 0;
+    Tail = 0;
+    Started = 0;
+    Delay = delay_ms;
+    NumPrev = 0;
+    InUnderrun = 0;
+    Packets = 0;
+    Late = 0;
+    Overflows = 0;
+    Underruns = 0;
+    UnderrunTicks = 0;
+    SlackSum = 0;
+    SlackMin = 0;
+    __builtin_enable_interrupts();
+}
+
+//
+// Add a setpoint from the main loop. Returns 0 if it was dropped.
+//
+int stream_push(int t_ms, int counts) {
+    if (!Started) {
+        Now = t_ms - Delay;     // First packet anchors the stream clock
+        LastT = t_ms - 1;
+        Started = 1;
+    }
+    if (t_ms <= LastT) {
+        return 0;               // Out of order or duplicate
+    }
+    int next = (Head + 1) % STREAM_DEPTH;
+    if (next == Tail) {
+        Overflows++;
+        return 0;
+    }
+
+    // Playout slack: how long this setpoint waits in the buffer. This is
+    // the margin left for link jitter, not the end-to-end latency.
+    int slack = t_ms - Now;
+    if (Packets == 0 || slack < SlackMin) {
+        SlackMin = slack;
+    }
+    Packets++;
+    if (slack < 0) {
+        Late++;
+    }
+    SlackSum += slack;
+
+    Buffer[Head].t = t_ms;
+    Buffer[Head].pos = counts;
+    LastT = t_ms;
+    Head = next;
+    return 1;
+}
+
+//
+// Get the setpoint for this position tick and advance the stream clock.
+// Returns 0 if there is nothing to play out yet.
+//
+int stream_sample(int *counts) {
+    if (!Started) {
+        return 0;
+    }
+
+    // Retire every setpoint whose time has come
+    while (Tail != Head && Buffer[Tail].t <= Now) {
+        PrevPrev = Prev;
+        Prev = Buffer[Tail];
+        Tail = (Tail + 1) % STREAM_DEPTH;
+        NumPrev++;
+    }
+
+    int valid = 1;
+    if (Tail != Head) {
+        volatile Setpoint *q = &Buffer[Tail];
+        if (NumPrev > 0) {  // Interpolate toward the next setpoint
+            *counts = Prev.pos + (q->pos - Prev.pos) * (Now - Prev.t) / (q->t - Prev.t);
+        } else {
+            *counts = q->pos;
+        }
+        InUnderrun = 0;
+    } else if (NumPrev > 0) {
+        int dt = Now - Prev.t;
+        if (dt > 0) {       // Late packet: extrapolate along the last segment
+            UnderrunTicks++;
+            if (!InUnderrun) {
+                Underruns++;
+                InUnderrun = 1;
+            }
+        }
+        if (dt > STREAM_MAX_EXTRAP) {
+            dt = STREAM_MAX_EXTRAP;
+        }
+        *counts = Prev.pos;
+        if (NumPrev > 1 && dt > 0) {
+            *counts += (Prev.pos - PrevPrev.pos) * dt / (Prev.t - PrevPrev.t);
+        }
+    } else {
+        valid = 0;
+    }
+
+    Now += STREAM_TICK_MS;
+    return valid;
+}
+
+//
+// Send stream statistics to Python:
+// packets, late packets, overflows, underruns, underrun time (ms),
+// mean and min playout slack (ms), playout delay (ms)
+//
+void send_stream_stats() {
+    char message[100];
+    float mean = (Packets > 0) ? SlackSum / Packets : 0;
+    sprintf(message, "%d %d %d %d %d %f %d %d\r\n", Packets, Late, Overflows, Underruns,
+            UnderrunTicks * STREAM_TICK_MS, mean, SlackMin, Delay);
+    NU32DIP_WriteUART1(message);
+}
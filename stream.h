@@ -0,0 +1,11 @@
+#ifndef STREAM__H__
+#define STREAM__H__
+
+#define STREAM_DEPTH 32           // Jitter buffer size (setpoints)
+
+void stream_start(int delay_ms);
+int stream_push(int t_ms, int counts);
+int stream_sample(int *counts);
+void send_stream_stats();
+
+#endif // STREAM__H__
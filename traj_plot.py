@@ -7,7 +7,10 @@
 # Date: 3/17/2025
 #
 import matplotlib.pyplot as plt
+import numpy as np
 from statistics import mean
+from math import log10, sin, cos, exp, pi
+import time
 
 #
 # Generate reference trajectory for given trajectory type
@@ -40,8 +43,8 @@ def gen_ref_trajectory(method):
     for i in range(2, len(reflist), 2):
         if reflist[i] <= reflist[i-2]:
             dataok = 0
-        if reflist[i-2] > 10 or reflist[i] > 10:
-            print('Maximum trajectory time is 10 seconds!\n')
+        if reflist[i-2] > 11.5 or reflist[i] > 11.5:
+            print('Maximum trajectory time is 11.5 seconds!\n')
             return [-1]
     if dataok == 0:
         print('Not a valid input: time must increase!\n')
@@ -102,6 +105,123 @@ def gen_ref_trajectory(method):
 
     return ref
 
+# Default motion limits, from the motor's no-load speed and stall torque
+MAX_VELOCITY = 500.0        # deg/s
+MAX_ACCELERATION = 5000.0   # deg/s^2
+MAX_JERK = 100000.0         # deg/s^3
+
+def _segment_phases(dist, vmax, amax, jmax, method):
+    """
+    Computes the phases of minimum-time rest-to-rest moves.
+
+    :param dist: Array of move distances (deg, non-negative).
+    :param method: 'trap' (acceleration limited) or 'scurve' (jerk limited).
+    :return: (durations, jerks, start accelerations) arrays of shape
+             (len(dist), phases), for a move in the positive direction.
+    """
+    dist = np.asarray(dist, dtype=float)
+    if method == 'trap':
+        # Peak velocity is vmax, or lower if the move is too short to reach it
+        vpeak = np.minimum(vmax, np.sqrt(dist*amax))
+        ta = vpeak/amax
+        tc = np.where(vpeak > 0, dist/np.maximum(vpeak, 1e-12) - ta, 0.0)
+        durations = np.stack([ta, tc, ta], axis=1)
+        jerks = np.zeros_like(durations)
+        accels = np.tile([amax, 0.0, -amax], (len(dist), 1))
+        return durations, jerks, accels
+
+    # S-curve: peak velocity limited by vmax or by the distance
+    a2j = amax*amax/jmax
+    v_full = (-a2j + np.sqrt(a2j*a2j + 4*amax*dist))/2     # Reaches amax
+    v_short = np.cbrt(dist*dist*jmax/4)                     # Never reaches amax
+    vpeak = np.minimum(vmax, np.where(v_full*jmax >= amax*amax, v_full, v_short))
+    apeak = np.minimum(amax, np.sqrt(vpeak*jmax))
+    tj = apeak/jmax                                         # Jerk phase
+    ta = np.where(apeak > 0, vpeak/np.maximum(apeak, 1e-12) - tj, 0.0)   # Constant accel phase
+    dacc = vpeak*(2*tj + ta)/2                              # Distance to reach vpeak
+    tc = np.where(vpeak > 0, (dist - 2*dacc)/np.maximum(vpeak, 1e-12), 0.0)
+    durations = np.stack([tj, ta, tj, np.maximum(tc, 0.0), tj, ta, tj], axis=1)
+    jerks = np.outer(np.ones(len(dist)), [1, 0, -1, 0, -1, 0, 1])*jmax
+    accels = np.stack([np.zeros_like(apeak), apeak, apeak, np.zeros_like(apeak),
+                       np.zeros_like(apeak), -apeak, -apeak], axis=1)
+    return durations, jerks, accels
+
+def gen_optimal_trajectory(angles, method='scurve', vmax=MAX_VELOCITY,
+                           amax=MAX_ACCELERATION, jmax=MAX_JERK, rate=200):
+    """
+    Generates a minimum-time trajectory through via points under velocity,
+    acceleration and (for 'scurve') jerk limits. The motor comes to rest at
+    each via point, so every segment is a time-optimal point-to-point move.
+    Evaluation is vectorised over all samples of all segments at once.
+
+    :param angles: Via point angles (deg), starting position first.
+    :param method: 'trap' for trapezoidal or 'scurve' for jerk limited.
+    :param rate: Sample rate (Hz), the position control ISR rate.
+    :return: List of reference angles sampled at rate.
+    """
+    angles = np.asarray(angles, dtype=float)
+    delta = np.diff(angles)
+    durations, jerks, accels = _segment_phases(np.abs(delta), vmax, amax, jmax, method)
+    sign = np.sign(delta)[:, None]
+
+    # Flatten phases of every segment onto one timeline
+    dur = durations.ravel()
+    jerk = (jerks*sign).ravel()
+    acc0 = (accels*sign).ravel()
+    start = np.concatenate(([0.0], np.cumsum(dur)[:-1]))
+
+    # State at the start of each phase: velocity restarts at 0 for every
+    # segment, position at the segment's first via point
+    nphase = durations.shape[1]
+    dv = acc0*dur + jerk*dur*dur/2
+    vel0 = np.cumsum(dv.reshape(-1, nphase), axis=1) - dv.reshape(-1, nphase)
+    vel0 = vel0.ravel()
+    dp = vel0*dur + acc0*dur*dur/2 + jerk*dur**3/6
+    pos0 = np.cumsum(dp.reshape(-1, nphase), axis=1) - dp.reshape(-1, nphase)
+    pos0 = (pos0 + angles[:-1, None]).ravel()
+
+    # Evaluate every sample in the phase it falls in
+    total = start[-1] + dur[-1] if len(dur) else 0.0
+    t = np.arange(int(np.ceil(total*rate)) + 1)/rate
+    idx = np.clip(np.searchsorted(start, t, side='right') - 1, 0, max(len(start) - 1, 0))
+    tau = np.clip(t - start[idx], 0.0, dur[idx]) if len(dur) else t
+    ref = (pos0[idx] + vel0[idx]*tau + acc0[idx]*tau*tau/2 + jerk[idx]*tau**3/6) if len(dur) else \
+        np.full_like(t, angles[0])
+    ref[-1] = angles[-1]
+    return ref.tolist()
+
+def input_optimal_trajectory():
+    """
+    Prompts for via points and motion limits, then generates a
+    time-optimal trajectory with gen_optimal_trajectory().
+
+    :return: List of reference angles, or [-1] on invalid input.
+    """
+    method = input('ENTER PROFILE (trap or scurve): ').strip()
+    if method not in ('trap', 'scurve'):
+        print('INVALID TRAJECTORY TYPE')
+        return [-1]
+    try:
+        angles = list(map(float, input('Enter angles of via points, starting position first: ').split()))
+        vmax = float(input(f'ENTER MAX VELOCITY (deg/s) [{MAX_VELOCITY}]: ') or MAX_VELOCITY)
+        amax = float(input(f'ENTER MAX ACCELERATION (deg/s^2) [{MAX_ACCELERATION}]: ') or MAX_ACCELERATION)
+        jmax = MAX_JERK
+        if method == 'scurve':
+            jmax = float(input(f'ENTER MAX JERK (deg/s^3) [{MAX_JERK}]: ') or MAX_JERK)
+    except ValueError:
+        print('Not a valid input!\n')
+        return [-1]
+    if len(angles) < 2 or vmax <= 0 or amax <= 0 or jmax <= 0:
+        print('Not a valid input: need two via points and positive limits!\n')
+        return [-1]
+
+    print(f'GENERATING {method.upper()} TRAJECTORY')
+    ref = gen_optimal_trajectory(angles, method, vmax, amax, jmax)
+    if len(ref) > 2300:
+        print('Maximum trajectory time is 11.5 seconds!\n')
+        return [-1]
+    return ref
+
 def plot_trajectory(ser):
     """
     This function is called after menu command "o" (Execute trajectory).
@@ -109,24 +229,33 @@ def plot_trajectory(ser):
     and plots them.
 
     :param ser: Access to serial port to interface with PIC32.
+    :return: (columns, score) where columns holds the angle, ref, current
+             and duty arrays, or None if no trajectory was loaded.
     """
     actual = []
     ref = []
+    current = []
+    duty = []
 
     data_read = ser.read_until(b'\n',50)   # Read trajectory length
     data_text = str(data_read,'utf-8')
     traj_length = int(data_text)
+    if traj_length == 0:
+        print('No trajectory loaded!\n')
+        return
 
     # Read current data arrays
     for sample in range(traj_length):
         # Read from PIC
-        data_read = ser.read_until(b'\n',50)
+        data_read = ser.read_until(b'\n',100)
         data_text = str(data_read,'utf-8')
-        data = list(map(float,data_text.split()))   # [samp_num, actual, ref]
+        data = list(map(float,data_text.split()))   # [samp_num, actual, ref, current, duty]
 
         # Create arrays for plotting
         actual.append(data[1])
         ref.append(data[2])
+        current.append(data[3])
+        duty.append(data[4])
 
     # Score trajectory performance
     mean_list = []
@@ -141,6 +270,7 @@ def plot_trajectory(ser):
     plt.ylabel('Current (mA)')
     plt.xlabel('Sample')
     plt.show()
+    return {'angle': actual, 'ref': ref, 'current': current, 'duty': duty}, score
 
 def plot_itest(ser):
     """
@@ -149,23 +279,27 @@ def plot_itest(ser):
     and plots them.
 
     :param ser: Access to serial port to interface with PIC32.
+    :return: (columns, score) where columns holds the current, ref and duty
+             arrays and score is the mean absolute error.
     """
     sampnum = 0
     read_samples = 100
     curr_actual = []
     curr_ref = []
+    curr_duty = []
 
     # Read current data arrays
     while read_samples > 1:
         # Read from PIC
-        data_read = ser.read_until(b'\n',50)
+        data_read = ser.read_until(b'\n',100)
         data_text = str(data_read,'utf-8')
-        data = list(map(float,data_text.split()))   # [samp_num, actual, ref]
+        data = list(map(float,data_text.split()))   # [samp_num, actual, ref, duty]
 
         # Create arrays for plotting
         read_samples = int(data[0])
         curr_actual.append(data[1])
         curr_ref.append(data[2])
+        curr_duty.append(data[3] if len(data) > 3 else 0.0)
         sampnum = sampnum + 1
 
     # Plot current data
@@ -173,4 +307,240 @@ def plot_itest(ser):
     plt.plot(t, curr_actual, 'r*-', t, curr_ref, 'b*-')
     plt.ylabel('Current (mA)')
     plt.xlabel('Sample')
-    plt.show()
\ No newline at end of file
+    plt.show()
+
+    score = mean(abs(i-j) for i,j in zip(curr_ref, curr_actual))
+    return {'current': curr_actual, 'ref': curr_ref, 'duty': curr_duty}, score
+
+CAPTURE_STATES = ['STOPPED', 'ARMED', 'TRIGGERED', 'FROZEN']
+
+def plot_capture(ser):
+    """
+    This function is called after menu command "V" (Upload capture).
+    It reads the capture status and, if the capture has frozen, its
+    samples, and plots them against time from the trigger.
+
+    :param ser: Access to serial port to interface with PIC32.
+    :return: (columns, metrics) where columns holds the current, ref, duty
+             and angle arrays, or None if no capture is ready.
+    """
+    data = list(map(int, ser.read_until(b'\n',100).split())) # [state, trigger, rate, decimation, n, pre]
+    state, trigger, rate, decimation, n, pre = data
+    if CAPTURE_STATES[state] != 'FROZEN':
+        print(f'Capture {CAPTURE_STATES[state]}, nothing to upload\n')
+        return None
+
+    samples = np.array([list(map(int, ser.read_until(b'\n',100).split())) for _ in range(n)]).reshape(-1, 4)
+    t = (np.arange(n) - pre) * decimation * 1000.0 / rate   # ms from the trigger
+    current, ref, duty, angle = samples.T
+    duty_pct = duty * 100.0 / 2400.0
+    angle_deg = angle / 3.7111
+
+    fig, axes = plt.subplots(3, 1, sharex=True)
+    axes[0].plot(t, current, 'r-', t, ref, 'b-')
+    axes[0].set_ylabel('Current (mA)')
+    axes[1].plot(t, duty_pct, 'g-')
+    axes[1].set_ylabel('Duty (%)')
+    axes[2].plot(t, angle_deg, 'k-')
+    axes[2].set_ylabel('Angle (deg)')
+    axes[2].set_xlabel('Time from trigger (ms)')
+    for ax in axes:
+        ax.axvline(0, color='gray', linestyle='--')
+    plt.show()
+
+    columns = {'t_ms': t, 'current': current, 'ref': ref, 'duty': duty_pct, 'angle': angle_deg}
+    return columns, {'trigger': trigger, 'rate': rate, 'decimation': decimation, 'pre': pre}
+
+def read_metrics(ser):
+    """
+    Reads one metrics summary line from the PIC, sent after menu commands
+    "s", "t" and "u". The PIC accumulates these while the run executes,
+    so no sample data has to be transferred.
+
+    :param ser: Access to serial port to interface with PIC32.
+    :return: Dictionary of tracking and step-response metrics. The step
+             fields are None if the reference had no step.
+    """
+    data_read = ser.read_until(b'\n',100)
+    data = str(data_read,'utf-8').split()
+    keys = ['mae', 'rms', 'max', 'overshoot', 'rise_ms', 'settle_ms']
+    metrics = dict(zip(keys, map(float, data[:6])))
+    metrics['steps'] = int(data[6])
+    metrics['samples'] = int(data[7])
+    if metrics['steps'] == 0:
+        for key in ('overshoot', 'rise_ms', 'settle_ms'):
+            metrics[key] = None
+    return metrics
+
+def print_metrics(name, metrics, unit):
+    """
+    Prints a metrics dictionary returned by read_metrics().
+
+    :param name: Name of the loop the metrics belong to.
+    :param metrics: Dictionary returned by read_metrics().
+    :param unit: Unit of the error terms.
+    """
+    print(f'{name} ({metrics["samples"]} samples, {metrics["steps"]} steps):')
+    print(f'\tMAE={metrics["mae"]:.3f} {unit}, RMS={metrics["rms"]:.3f} {unit}, Max={metrics["max"]:.3f} {unit}')
+    if metrics['steps'] == 0:
+        print('\tOvershoot=N/A, Rise=N/A, Settle=N/A (no step in the reference)\n')
+    else:
+        print(f'\tOvershoot={metrics["overshoot"]:.1f}%, Rise={metrics["rise_ms"]:.1f} ms, Settle={metrics["settle_ms"]:.1f} ms\n')
+
+def plot_bode(ser):
+    """
+    This function is called after menu command "v" (Current loop frequency
+    response). It reads the per-bin gain and phase computed on the PIC,
+    and plots the closed-loop and plant Bode diagrams.
+
+    :param ser: Access to serial port to interface with PIC32.
+    """
+    data_read = ser.read_until(b'\n',50)   # Read number of bins
+    num_bins = int(str(data_read,'utf-8'))
+    if num_bins == 0:
+        print('Invalid frequency sweep!\n')
+        return
+
+    freq, cl_mag, cl_ph, pl_mag, pl_ph = [], [], [], [], []
+    for sample in range(num_bins):
+        data_read = ser.read_until(b'\n',100)
+        data = list(map(float,str(data_read,'utf-8').split()))   # [f, cl_mag, cl_ph, pl_mag, pl_ph]
+        freq.append(data[0])
+        cl_mag.append(20*log10(max(data[1], 1e-9)))
+        cl_ph.append(data[2])
+        pl_mag.append(20*log10(max(data[3], 1e-9)))
+        pl_ph.append(data[4])
+
+    fig, (ax_mag, ax_ph) = plt.subplots(2, 1, sharex=True)
+    ax_mag.semilogx(freq, cl_mag, 'b*-', label='Closed loop (I/Iref)')
+    ax_mag.semilogx(freq, pl_mag, 'r*-', label='Plant (I/duty)')
+    ax_mag.set_ylabel('Gain (dB)')
+    ax_mag.legend()
+    ax_ph.semilogx(freq, cl_ph, 'b*-', freq, pl_ph, 'r*-')
+    ax_ph.set_ylabel('Phase (deg)')
+    ax_ph.set_xlabel('Frequency (Hz)')
+    plt.show()
+
+def stream_setpoints(ser, setpoint, duration, rate, delay):
+    """
+    This function is called after menu command "z" (Stream setpoints).
+    It sends timestamped setpoints in real time, as a host-side planner
+    would, then reads the jitter buffer statistics from the PIC.
+
+    The PIC echoes the first setpoint, which anchors its playout clock.
+    Every setpoint is then played out the delay plus half that round trip
+    after it was sent, which is reported as the end-to-end latency.
+
+    :param ser: Access to serial port to interface with PIC32.
+    :param setpoint: Function of time (s) returning the angle (deg).
+    :param duration: Length of the stream (s).
+    :param rate: Setpoints sent per second (at most 200).
+    :param delay: Playout delay of the jitter buffer (ms).
+    :return: Dictionary of stream statistics.
+    """
+    ser.write(f'{int(delay)}\n'.encode())   # Send playout delay
+    start = time.monotonic()
+    t = 0.0
+    rtt = None
+    while t < duration:
+        ser.write(f'{int(t*1000)} {setpoint(t):.2f}\n'.encode())
+        if rtt is None:
+            ser.read_until(b'\n')     # Echo of the anchoring setpoint
+            rtt = (time.monotonic() - start)*1000
+        t += 1/rate
+        wait = start + t - time.monotonic()
+        if wait > 0:
+            time.sleep(wait)
+    ser.write(b'e\n')  # End of stream
+
+    data_read = ser.read_until(b'\n',100)
+    data = str(data_read,'utf-8').split()
+    keys = ['packets', 'late', 'overflows', 'underruns', 'underrun_ms']
+    stats = dict(zip(keys, map(int, data[:5])))
+    stats['mean_slack_ms'] = float(data[5])  # Arrival to playout, not end-to-end latency
+    stats['min_slack_ms'] = int(data[6])
+    stats['delay_ms'] = int(data[7])
+    stats['rtt_ms'] = rtt if rtt is not None else 0.0
+    stats['latency_ms'] = stats['delay_ms'] + stats['rtt_ms']/2
+    return stats
+
+FILTER_Q = 14                   # Firmware derivative coefficient fraction bits
+FILTER_BIQUAD_Q = 30            # Firmware biquad coefficient fraction bits
+FILTER_RATES = [5000, 200]      # Sample rate (Hz) of each firmware filter channel
+FILTER_CHANNELS = ['current', 'position']
+
+def biquad_coefficients(kind, f0, q, fs):
+    """
+    Designs an RBJ cookbook biquad and quantises it for the firmware.
+
+    :param kind: 'lowpass' or 'notch'.
+    :param f0: Cutoff or notch frequency (Hz).
+    :param q: Quality factor.
+    :param fs: Sample rate (Hz).
+    :return: [b0, b1, b2, a1, a2] in Q30, normalised so a0 = 1.
+    """
+    if not 0 < f0 < fs/2 or q <= 0:
+        raise ValueError('frequency must be between 0 and fs/2, and Q positive')
+    w = 2*pi*f0/fs
+    alpha = sin(w)/(2*q)
+    if kind == 'lowpass':
+        b = [(1 - cos(w))/2, 1 - cos(w), (1 - cos(w))/2]
+    elif kind == 'notch':
+        b = [1, -2*cos(w), 1]
+    else:
+        raise ValueError(f'unknown filter type {kind}')
+    a0 = 1 + alpha
+    coeffs = [v/a0 for v in b + [-2*cos(w), 1 - alpha]]
+    quant = [round(v*(1 << FILTER_BIQUAD_Q)) for v in coeffs]
+    if any(not -(1 << 31) <= v < (1 << 31) for v in quant):
+        raise ValueError('coefficient out of Q30 range')
+    return quant
+
+def derivative_alpha(fc, fs):
+    """
+    :return: Q14 coefficient of the first order low-pass on the derivative
+             for cutoff fc (Hz), or 1.0 (raw difference) if fc is 0.
+    """
+    if fc <= 0:
+        return 1 << FILTER_Q
+    return round((1 - exp(-2*pi*fc/fs))*(1 << FILTER_Q))
+
+def input_filter():
+    """
+    Prompts for a filter channel configuration.
+
+    :return: Lines to send after menu command "G", or None on invalid input.
+    """
+    try:
+        ch = int(input('ENTER CHANNEL (0 current, 1 position): '))
+        fs = FILTER_RATES[ch]
+        median = int(input('MEDIAN-OF-3 SPIKE REJECTION (0 off, 1 on): '))
+        stages = []
+        for kind in ('lowpass', 'notch'):
+            f0 = float(input(f'ENTER {kind.upper()} FREQUENCY (Hz, 0 for none, fs = {fs} Hz): ') or 0)
+            if f0 > 0:
+                q = float(input('ENTER Q [0.707]: ') or 0.707)
+                stages.append(biquad_coefficients(kind, f0, q, fs))
+        fc = float(input('ENTER DERIVATIVE CUTOFF (Hz, 0 for raw difference): ') or 0)
+        alpha = derivative_alpha(fc, fs)
+    except (ValueError, IndexError) as e:
+        print(f'Not a valid input! {e}\n')
+        return None
+    lines = [f'{ch} {median} {len(stages)} {alpha}']
+    lines += [' '.join(map(str, c)) for c in stages]
+    return lines
+
+def print_filter_costs(ser):
+    """
+    This function is called after menu command "H" (Get filter costs).
+    It reads the per-sample cost of each filter stage and compares it
+    with the channel's sample period.
+
+    :param ser: Access to serial port to interface with PIC32.
+    """
+    for name, fs in zip(FILTER_CHANNELS, FILTER_RATES):
+        data = list(map(float, ser.read_until(b'\n').split())) # [last, max] per stage (us)
+        print(f'{name} channel ({1e6/fs:.0f} us per sample):')
+        for i, stage in enumerate(('median', 'biquads', 'derivative')):
+            print(f'\t{stage}: last {data[2*i]:.2f} us, worst {data[2*i+1]:.2f} us')
+        print(f'\ttotal worst: {sum(data[1::2]):.2f} us')
@@ -6,6 +6,7 @@
 // Date: 03/08/2025
 //
 #include "utilities.h"
+#include "protection.h"
 
 
 
@@ -16,5 +17,8 @@ Mode get_mode() {
 }
 
 void set_mode(Mode m) {
+    if (m != IDLE && protection_tripped()) {
+        return;     // Stay unpowered until the fault is cleared
+    }
     mode = m;
 }
\ No newline at end of file
@@ -8,14 +8,21 @@ typedef enum {
     PWM,
     ITEST,
     HOLD,
-    TRACK
+    TRACK,
+    FRESP,
+    STREAM,
+    QUEUE,
+    AUTOTUNE,
+    NUM_MODES        // Number of modes, not a mode
 } Mode;
 
 Mode get_mode();
 void set_mode(Mode m);
 
 #define ITEST_NUMSAMPS 100       // Number of points in ITEST reference
-#define TRAJ_NUMSAMPS 2000       // Max numer of samples for referenc trajectories
+#define TRAJ_NUMSAMPS 2300       // Max numer of samples for referenc trajectories
 #define BUF_SIZE 200             // Size for reading  inputs
+#define CURRENT_LOOP_HZ 5000     // Current control ISR rate
+#define POSITION_LOOP_HZ 200     // Position control ISR rate
 
 #endif // UTILITIES__H__
\ No newline at end of file